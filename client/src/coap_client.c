@@ -5,39 +5,111 @@
  */
 #include <zephyr/logging/log.h>
 #include <zephyr/net/socket.h>
+#include <zephyr/net/tls_credentials.h>
+#include <zephyr/random/random.h>
+#include <zephyr/sys/util.h>
 
 #include <fcntl.h>
 #include <errno.h>
+#include <string.h>
 
 #include "coap_client.h"
 
 LOG_MODULE_REGISTER(coap_client, LOG_LEVEL_INF);
 
-int coap_client_start(coap_client_t *client, const char *const peer_addr, uint16_t port)
+// The low bits of a token hold the slot index, so replies are matched with a
+// single lookup. The bits above hold a generation that tells a late reply to
+// an abandoned request apart from the request now using the slot.
+#define SLOT_BITS LOG2CEIL(COAP_CLIENT_MAX_IN_FLIGHT)
+#define SLOT_MASK (BIT(SLOT_BITS) - 1)
+
+BUILD_ASSERT(SLOT_BITS < COAP_CLIENT_TOKEN_LEN * 8, "No token bits left for the generation");
+
+#ifdef CONFIG_NET_SOCKETS_SOCKOPT_TLS
+static int configure_dtls(int sock, sec_tag_t sec_tag)
 {
-    if (client == NULL || peer_addr == NULL) {
-        return -EINVAL;
+    sec_tag_t sec_tag_list[] = { sec_tag };
+    int rc = setsockopt(sock, SOL_TLS, TLS_SEC_TAG_LIST, sec_tag_list, sizeof(sec_tag_list));
+    if (rc < 0) {
+        LOG_ERR("Failed to set security tag: %d", errno);
+        return -errno;
     }
 
-    int rc = 0;
-    struct sockaddr_in6 addr6;
+    // Offer the session of an earlier connection to the same peer. Only a peer
+    // that caches sessions resumes it; the server here does a full handshake.
+    int session_cache = TLS_SESSION_CACHE_ENABLED;
+    rc = setsockopt(sock, SOL_TLS, TLS_SESSION_CACHE, &session_cache, sizeof(session_cache));
+    if (rc < 0) {
+        LOG_WRN("Session cache not available: %d", errno);
+    }
+
+#ifdef TLS_DTLS_CID
+    // Let the session survive a change of our address without a new handshake.
+    int cid = TLS_DTLS_CID_SUPPORTED;
+    rc = setsockopt(sock, SOL_TLS, TLS_DTLS_CID, &cid, sizeof(cid));
+    if (rc < 0) {
+        LOG_WRN("DTLS connection ID not available: %d", errno);
+    }
+#endif
+
+#ifdef TLS_DTLS_HANDSHAKE_ON_CONNECT
+    // Handshake in connect() rather than on the first request, keeping it
+    // off the transmit path.
+    int handshake_on_connect = 1;
+    rc = setsockopt(sock, SOL_TLS, TLS_DTLS_HANDSHAKE_ON_CONNECT, &handshake_on_connect,
+                    sizeof(handshake_on_connect));
+    if (rc < 0) {
+        LOG_WRN("Handshake on connect not available: %d", errno);
+    }
+#endif
+
+    return 0;
+}
+#endif // CONFIG_NET_SOCKETS_SOCKOPT_TLS
 
-    addr6.sin6_family = AF_INET6;
-    addr6.sin6_port = htons(port);
-    addr6.sin6_scope_id = 0U;
+static int open_socket(coap_client_t *client)
+{
+    int rc = 0;
+    bool secure = client->sec_tag >= 0;
 
-    inet_pton(AF_INET6, peer_addr, &addr6.sin6_addr);
+#ifndef CONFIG_NET_SOCKETS_SOCKOPT_TLS
+    if (secure) {
+        return -ENOTSUP;
+    }
+#endif
 
-    client->sock = socket(addr6.sin6_family, SOCK_DGRAM, IPPROTO_UDP);
+    client->sock = socket(client->peer.sin6_family, SOCK_DGRAM,
+                          secure ? IPPROTO_DTLS_1_2 : IPPROTO_UDP);
     if (client->sock < 0) {
-        LOG_ERR("Failed to create UDP socket %d", errno);
+        LOG_ERR("Failed to create %s socket %d", secure ? "DTLS" : "UDP", errno);
         return -errno;
     }
 
-    rc = connect(client->sock, (struct sockaddr *)&addr6, sizeof(addr6));
+#ifdef CONFIG_NET_SOCKETS_SOCKOPT_TLS
+    if (secure) {
+        rc = configure_dtls(client->sock, client->sec_tag);
+        if (rc < 0) {
+            close(client->sock);
+            client->sock = -1;
+            return rc;
+        }
+    }
+#endif
+
+    int64_t start = k_uptime_get();
+
+    rc = connect(client->sock, (struct sockaddr *)&client->peer, sizeof(client->peer));
     if (rc < 0) {
-        LOG_ERR("Cannot connect to UDP remote : %d", errno);
-        return -errno;
+        LOG_ERR("Cannot connect to %s remote: %d", secure ? "DTLS" : "UDP", errno);
+        rc = -errno;
+        close(client->sock);
+        client->sock = -1;
+        return rc;
+    }
+
+    if (secure) {
+        client->handshake_ms = (uint32_t)(k_uptime_get() - start);
+        LOG_INF("DTLS connect completed in %u ms", client->handshake_ms);
     }
 
     // Set the socket to non-blocking mode.
@@ -54,6 +126,131 @@ int coap_client_start(coap_client_t *client, const char *const peer_addr, uint16
     return 0;
 }
 
+static void release_requests(coap_client_t *client)
+{
+    memset(client->requests, 0, sizeof(client->requests));
+}
+
+static int alloc_request(coap_client_t *client)
+{
+    for (size_t n = 0; n < COAP_CLIENT_MAX_IN_FLIGHT; n++) {
+        uint8_t index = (client->next_slot + n) % COAP_CLIENT_MAX_IN_FLIGHT;
+        coap_client_request_t *request = &client->requests[index];
+        if (request->in_use) {
+            continue;
+        }
+
+        uint16_t value = (uint16_t)(client->generation++ << SLOT_BITS) | index;
+
+        memset(request, 0, sizeof(*request));
+        request->in_use = true;
+        request->id = client->next_id++;
+        for (size_t i = 0; i < COAP_CLIENT_TOKEN_LEN; i++) {
+            request->token[COAP_CLIENT_TOKEN_LEN - 1 - i] = (uint8_t)(value >> (8 * i));
+        }
+
+        client->next_slot = (index + 1) % COAP_CLIENT_MAX_IN_FLIGHT;
+
+        return index;
+    }
+
+    return -EBUSY;
+}
+
+static coap_client_request_t *find_request(coap_client_t *client, const struct coap_packet *reply)
+{
+    uint8_t token[COAP_TOKEN_MAX_LEN];
+    uint16_t value = 0;
+
+    if (coap_header_get_token(reply, token) != COAP_CLIENT_TOKEN_LEN) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < COAP_CLIENT_TOKEN_LEN; i++) {
+        value = (value << 8) | token[i];
+    }
+
+    uint16_t index = value & SLOT_MASK;
+    if (index >= COAP_CLIENT_MAX_IN_FLIGHT) {
+        return NULL;
+    }
+
+    coap_client_request_t *request = &client->requests[index];
+    if (!request->in_use || memcmp(request->token, token, COAP_CLIENT_TOKEN_LEN) != 0) {
+        return NULL;
+    }
+
+    return request;
+}
+
+static int start(coap_client_t *client, const char *const peer_addr, uint16_t port, int sec_tag)
+{
+    if (client == NULL || peer_addr == NULL) {
+        return -EINVAL;
+    }
+
+    // Random starting points, so that replies to requests sent before a
+    // reboot are not mistaken for replies to new ones.
+    client->next_id = (uint16_t)sys_rand32_get();
+    client->generation = (uint16_t)sys_rand32_get();
+    client->next_slot = 0;
+    release_requests(client);
+
+    client->peer.sin6_family = AF_INET6;
+    client->peer.sin6_port = htons(port);
+    client->peer.sin6_scope_id = 0U;
+    client->sec_tag = sec_tag;
+
+    if (inet_pton(AF_INET6, peer_addr, &client->peer.sin6_addr) != 1) {
+        LOG_ERR("Invalid peer address %s", peer_addr);
+        return -EINVAL;
+    }
+
+    return open_socket(client);
+}
+
+int coap_client_start(coap_client_t *client, const char *const peer_addr, uint16_t port)
+{
+    return start(client, peer_addr, port, -1);
+}
+
+int coap_client_start_secure(coap_client_t *client, const char *const peer_addr, uint16_t port,
+                             int sec_tag)
+{
+    if (sec_tag < 0) {
+        return -EINVAL;
+    }
+
+    return start(client, peer_addr, port, sec_tag);
+}
+
+int coap_client_reconnect(coap_client_t *client)
+{
+    if (client == NULL) {
+        return -EINVAL;
+    }
+
+    int64_t start = k_uptime_get();
+
+    if (client->sock >= 0) {
+        close(client->sock);
+    }
+
+    // Replies to the old socket will not arrive.
+    release_requests(client);
+
+    int rc = open_socket(client);
+    if (rc < 0) {
+        return rc;
+    }
+
+    client->reconnect_ms = (uint32_t)(k_uptime_get() - start);
+    client->reconnects++;
+    LOG_INF("Reconnected in %u ms (%u reconnects)", client->reconnect_ms, client->reconnects);
+
+    return 0;
+}
+
 int coap_client_stop(coap_client_t *client)
 {
     if (client == NULL) {
@@ -64,9 +261,110 @@ int coap_client_stop(coap_client_t *client)
 
     client->sock = -1;
     client->nfds = 0;
+    release_requests(client);
+
+    return 0;
+}
+
+#ifdef CONFIG_TLS_CREDENTIALS
+int coap_client_add_psk(int sec_tag, const char *const psk_hex, const char *const identity)
+{
+    // The credentials store keeps a pointer to the key, so each security tag
+    // needs a buffer of its own that outlives the sockets using it.
+    static struct {
+        bool in_use;
+        int sec_tag;
+        uint8_t psk[32];
+    } keys[COAP_CLIENT_MAX_PSKS];
+
+    uint8_t psk[sizeof(keys[0].psk)];
+
+    if (psk_hex == NULL || identity == NULL) {
+        return -EINVAL;
+    }
+
+    size_t psk_len = hex2bin(psk_hex, strlen(psk_hex), psk, sizeof(psk));
+    if (psk_len == 0) {
+        LOG_ERR("Invalid PSK");
+        return -EINVAL;
+    }
+
+    size_t i;
+    for (i = 0; i < ARRAY_SIZE(keys); i++) {
+        if (!keys[i].in_use || keys[i].sec_tag == sec_tag) {
+            break;
+        }
+    }
+
+    if (i == ARRAY_SIZE(keys)) {
+        LOG_ERR("No room for the PSK of security tag %d", sec_tag);
+        return -ENOMEM;
+    }
+
+    if (keys[i].in_use) {
+        // Already registered. Overwriting the buffer would change the key
+        // under the sessions that use it.
+        return 0;
+    }
+
+    keys[i].in_use = true;
+    keys[i].sec_tag = sec_tag;
+    memcpy(keys[i].psk, psk, psk_len);
+
+    int rc = tls_credential_add(sec_tag, TLS_CREDENTIAL_PSK, keys[i].psk, psk_len);
+    if (rc < 0 && rc != -EEXIST) {
+        LOG_ERR("Failed to add PSK: %d", rc);
+        keys[i].in_use = false;
+        return rc;
+    }
+
+    rc = tls_credential_add(sec_tag, TLS_CREDENTIAL_PSK_ID, identity, strlen(identity));
+    if (rc < 0 && rc != -EEXIST) {
+        LOG_ERR("Failed to add PSK identity: %d", rc);
+        tls_credential_delete(sec_tag, TLS_CREDENTIAL_PSK);
+        keys[i].in_use = false;
+        return rc;
+    }
 
     return 0;
 }
+#endif // CONFIG_TLS_CREDENTIALS
+
+#ifdef CONFIG_APP_OSCORE_SEQ_STEP
+int coap_client_set_oscore(coap_client_t *client, oscore_ctx_t *ctx)
+{
+    if (client == NULL) {
+        return -EINVAL;
+    }
+
+    client->oscore = ctx;
+
+    return 0;
+}
+
+static int unprotect_reply(coap_client_t *client, coap_client_request_t *request,
+                           struct coap_packet *reply, uint8_t *buf, size_t buf_len)
+{
+    uint8_t plain_data[OSCORE_MAX_MESSAGE];
+    struct coap_packet plain;
+
+    int rc = oscore_unprotect_response(client->oscore, &request->oscore_request, reply,
+                                       plain_data, sizeof(plain_data), &plain);
+    if (rc < 0) {
+        LOG_ERR("Failed to verify reply: %d", rc);
+        return rc;
+    }
+
+    if (plain.offset > buf_len) {
+        return -EMSGSIZE;
+    }
+
+    // Hand the plain reply back in the buffer of the caller.
+    memcpy(buf, plain_data, plain.offset);
+
+    return coap_packet_parse(reply, buf, plain.offset, NULL, 0);
+}
+#endif // CONFIG_APP_OSCORE_SEQ_STEP
 
 int coap_client_put(coap_client_t *client, const char *const *path, const uint8_t *const payload,
                     size_t payload_len)
@@ -75,19 +373,34 @@ int coap_client_put(coap_client_t *client, const char *const *path, const uint8_
         return -EINVAL;
     }
 
+    int index = alloc_request(client);
+    if (index < 0) {
+        LOG_WRN("No free request slot");
+        return index;
+    }
+
+    coap_client_request_t *pending = &client->requests[index];
+
     const size_t MESSAGE_SIZE = CONFIG_COAP_CLIENT_MESSAGE_HEADER_SIZE + payload_len;
 
     uint8_t *data = (uint8_t *)k_malloc(MESSAGE_SIZE);
     if (!data) {
+        pending->in_use = false;
         return -ENOMEM;
     }
 
+    struct coap_packet *out;
+#ifdef CONFIG_APP_OSCORE_SEQ_STEP
+    struct coap_packet protected;
+    uint8_t *protected_data = NULL;
+#endif
+
     LOG_DBG("Initializing CoAP packet");
 
     struct coap_packet request;
     int rc;
     rc = coap_packet_init(&request, data, MESSAGE_SIZE, COAP_VERSION_1, COAP_TYPE_CON,
-                          COAP_TOKEN_MAX_LEN, coap_next_token(), COAP_METHOD_PUT, coap_next_id());
+                          COAP_CLIENT_TOKEN_LEN, pending->token, COAP_METHOD_PUT, pending->id);
     if (rc < 0) {
         LOG_ERR("Failed to initialize CoAP packet: %d", rc);
         goto exit;
@@ -119,9 +432,32 @@ int coap_client_put(coap_client_t *client, const char *const *path, const uint8_
         goto exit;
     }
 
+    out = &request;
+
+#ifdef CONFIG_APP_OSCORE_SEQ_STEP
+    if (client->oscore != NULL) {
+        const size_t PROTECTED_SIZE = MESSAGE_SIZE + OSCORE_MAX_OVERHEAD;
+
+        protected_data = (uint8_t *)k_malloc(PROTECTED_SIZE);
+        if (!protected_data) {
+            rc = -ENOMEM;
+            goto exit;
+        }
+
+        rc = oscore_protect_request(client->oscore, &request, protected_data, PROTECTED_SIZE,
+                                    &protected, &pending->oscore_request);
+        if (rc < 0) {
+            LOG_ERR("Failed to protect CoAP packet: %d", rc);
+            goto exit;
+        }
+
+        out = &protected;
+    }
+#endif
+
     LOG_DBG("Sending CoAP packet");
 
-    ssize_t sent = send(client->sock, request.data, request.offset, 0);
+    ssize_t sent = send(client->sock, out->data, out->offset, 0);
     if (sent < 0) {
         LOG_ERR("Failed to send CoAP packet: %d", errno);
         rc = -errno;
@@ -129,29 +465,99 @@ int coap_client_put(coap_client_t *client, const char *const *path, const uint8_
     }
 
 exit:
+#ifdef CONFIG_APP_OSCORE_SEQ_STEP
+    k_free(protected_data);
+#endif
     k_free(data);
-    return rc;
+
+    if (rc < 0) {
+        pending->in_use = false;
+        return rc;
+    }
+
+    return index;
+}
+
+/**
+ * @brief Verify a received reply against the request it matches.
+ *
+ * @return int 0 if the reply is valid and in the buffer, otherwise a negative error code.
+ */
+static int accept_reply(coap_client_t *client, coap_client_request_t *match,
+                        struct coap_packet *reply, void *buf, size_t buf_len)
+{
+#ifdef CONFIG_APP_OSCORE_SEQ_STEP
+    if (client->oscore != NULL) {
+        return unprotect_reply(client, match, reply, buf, buf_len);
+    }
+#endif
+
+    return 0;
 }
 
-int coap_client_wait_and_receive(coap_client_t *client, struct coap_packet *reply, void *buf,
-                                 size_t buf_len, k_timeout_t timeout)
+int coap_client_wait_and_receive(coap_client_t *client, int request, struct coap_packet *reply,
+                                 void *buf, size_t buf_len, k_timeout_t timeout)
 {
-    if (client == NULL || buf == NULL) {
+    if (client == NULL || buf == NULL || request < 0 || request >= COAP_CLIENT_MAX_IN_FLIGHT ||
+        !client->requests[request].in_use) {
         return -EINVAL;
     }
 
+    coap_client_request_t *pending = &client->requests[request];
+    int64_t deadline = k_uptime_get() + k_ticks_to_ms_ceil32(timeout.ticks);
     int rc;
-    rc = poll(client->fds, client->nfds, k_ticks_to_ms_ceil32(timeout.ticks));
-    if (rc < 0) {
-        LOG_ERR("Failed to poll socket: %d", errno);
-        return -errno;
+
+    while (!pending->answered) {
+        int64_t remaining = MAX(deadline - k_uptime_get(), 0);
+
+        rc = poll(client->fds, client->nfds, (int)remaining);
+        if (rc < 0) {
+            LOG_ERR("Failed to poll socket: %d", errno);
+            rc = -errno;
+            goto exit;
+        }
+
+        if (rc == 0) {
+            rc = -EAGAIN;
+            goto exit;
+        }
+
+        ssize_t received = recv(client->sock, buf, buf_len, 0);
+        if (received < 0) {
+            LOG_ERR("Failed to receive data: %d", errno);
+            rc = -errno;
+            goto exit;
+        }
+
+        if (coap_packet_parse(reply, buf, received, NULL, 0) < 0) {
+            LOG_DBG("Dropping malformed reply");
+            continue;
+        }
+
+        coap_client_request_t *match = find_request(client, reply);
+        if (match == NULL) {
+            LOG_DBG("Dropping reply to an abandoned request");
+            continue;
+        }
+
+        rc = accept_reply(client, match, reply, buf, buf_len);
+        if (match == pending) {
+            goto exit;
+        }
+
+        // Keep the outcome for the call that collects it.
+        match->answered = true;
+        match->result = rc;
+        match->code = rc == 0 ? coap_header_get_code(reply) : 0;
     }
 
-    ssize_t received = recv(client->sock, buf, buf_len, 0);
-    if (received < 0) {
-        LOG_ERR("Failed to receive data: %d", errno);
-        return -errno;
+    rc = pending->result;
+    if (rc == 0) {
+        rc = coap_packet_init(reply, buf, buf_len, COAP_VERSION_1, COAP_TYPE_ACK,
+                              COAP_CLIENT_TOKEN_LEN, pending->token, pending->code, pending->id);
     }
 
-    return coap_packet_parse(reply, buf, received, NULL, 0);
+exit:
+    pending->in_use = false;
+    return rc;
 }
@@ -13,10 +13,43 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+// Only where OSCORE requests can be protected, see oscore_protect_request().
+#ifdef CONFIG_APP_OSCORE_SEQ_STEP
+#include "oscore.h"
+#endif
+
+#define COAP_CLIENT_MAX_IN_FLIGHT CONFIG_APP_COAP_CLIENT_MAX_IN_FLIGHT
+#define COAP_CLIENT_TOKEN_LEN CONFIG_APP_COAP_CLIENT_TOKEN_LEN
+#define COAP_CLIENT_MAX_PSKS 2 // Security tags that coap_client_add_psk() can hold
+
+typedef struct {
+    bool in_use; // Sent and not yet collected
+    bool answered; // The reply arrived while waiting for another request
+    int result; // 0 if the reply was valid, otherwise why it was rejected
+    uint8_t code; // Code of the reply, if answered and valid
+    uint16_t id; // Message ID of the request
+    uint8_t token[COAP_CLIENT_TOKEN_LEN]; // Slot index in the low bits, generation above
+#ifdef CONFIG_APP_OSCORE_SEQ_STEP
+    oscore_request_t oscore_request; // Binding of the request, to verify its reply
+#endif
+} coap_client_request_t;
+
 typedef struct {
     int sock; // Socket descriptor. Used to send and receive data
     struct pollfd fds[1]; // Polling structure used to wait for data
     int nfds; // Number of file descriptors to poll
+    struct sockaddr_in6 peer; // Address of the peer, kept for reconnects
+    int sec_tag; // Security tag of the DTLS credentials, or -1 for plaintext
+    uint32_t handshake_ms; // Duration of the last DTLS connect
+    uint32_t reconnect_ms; // Duration of the last reconnect, including the handshake
+    uint32_t reconnects; // Number of successful reconnects
+#ifdef CONFIG_APP_OSCORE_SEQ_STEP
+    oscore_ctx_t *oscore; // Security context protecting the requests, or NULL
+#endif
+    uint16_t next_id; // Message ID of the next request, starts at a random value
+    uint16_t generation; // Distinguishes successive requests in the same slot
+    uint8_t next_slot; // Where to start looking for a free slot
+    coap_client_request_t requests[COAP_CLIENT_MAX_IN_FLIGHT]; // Indexed by the token
 } coap_client_t;
 
 /**
@@ -29,6 +62,62 @@ typedef struct {
  */
 int coap_client_start(coap_client_t *client, const char *const peer_addr, uint16_t port);
 
+/**
+ * @brief Initiate and start the specified CoAP client over DTLS (CoAPS).
+ *
+ * Reconnecting offers the cached DTLS session to the peer, but the server of
+ * this application keeps no session cache, so every reconnect is a full
+ * handshake. A DTLS connection ID is negotiated
+ * when supported, so that the session survives address changes.
+ * 
+ * @param client The CoAP client to start.
+ * @param peer_addr The address of the peer to connect to.
+ * @param port The port of the peer to connect to.
+ * @param sec_tag The security tag of the DTLS credentials to use.
+ * @return int 0 if successful, otherwise a negative error code.
+ */
+int coap_client_start_secure(coap_client_t *client, const char *const peer_addr, uint16_t port,
+                             int sec_tag);
+
+/**
+ * @brief Reconnect the specified CoAP client to its peer.
+ *
+ * Used to recover when the peer has lost the DTLS session, e.g. after a reboot.
+ * Blocks for the whole handshake, so keep it off the transmit path.
+ * 
+ * @param client The CoAP client to reconnect.
+ * @return int 0 if successful, otherwise a negative error code.
+ */
+int coap_client_reconnect(coap_client_t *client);
+
+/**
+ * @brief Register a pre-shared key for use with coap_client_start_secure().
+ *
+ * The key is copied into a buffer of its own, up to COAP_CLIENT_MAX_PSKS
+ * security tags. Registering a security tag again keeps the first key.
+ * 
+ * @param sec_tag The security tag to register the key under.
+ * @param psk_hex The key, as a hex string.
+ * @param identity The identity of the key. Must stay valid, it is not copied.
+ * @return int 0 if successful, -ENOMEM if no more keys can be held,
+ * otherwise a negative error code.
+ */
+int coap_client_add_psk(int sec_tag, const char *const psk_hex, const char *const identity);
+
+#ifdef CONFIG_APP_OSCORE_SEQ_STEP
+/**
+ * @brief Protect the requests of the specified CoAP client with OSCORE.
+ *
+ * Requests are protected end-to-end and replies are verified against the
+ * request they answer. Unprotected replies are rejected with -EACCES.
+ * 
+ * @param client The CoAP client to protect.
+ * @param ctx The security context to use, or NULL to stop protecting.
+ * @return int 0 if successful, otherwise a negative error code.
+ */
+int coap_client_set_oscore(coap_client_t *client, oscore_ctx_t *ctx);
+#endif
+
 /**
  * @brief Stop the specified CoAP client.
  * 
@@ -39,25 +128,36 @@ int coap_client_stop(coap_client_t *client);
 
 /**
  * @brief Send a CoAP PUT request to the specified path.
+ *
+ * The request occupies an in-flight slot until its reply has been collected
+ * with coap_client_wait_and_receive(). Message IDs and tokens are drawn from
+ * the sequence space of the client, so no state is shared with other clients.
  * 
  * @param client The CoAP client to use.
  * @param path The path to send the PUT request to.
- * @return int 0 if successful, otherwise a negative error code.
+ * @return int The handle of the request if successful, -EBUSY if every slot
+ * is in flight, otherwise a negative error code.
  */
 int coap_client_put(coap_client_t *client, const char *const *path, const uint8_t *const payload,
                     size_t payload_len);
 
 /**
- * @brief Wait for a CoAP reply and receive it.
+ * @brief Wait for the reply to the specified request and receive it.
+ *
+ * Replies to other requests of the client that arrive in the meantime are
+ * matched to their slot and kept for their own call. Only the code of such a
+ * reply is kept, so the packet handed back for it carries no options or
+ * payload. The slot is released whether or not the reply arrived.
  * 
  * @param client The CoAP client to use.
+ * @param request The handle returned by coap_client_put().
  * @param reply The CoAP packet to receive the reply into.
  * @param buf Buffer to store the reply in.
  * @param buf_len The length of the buffer.
  * @param timeout The timeout to wait for the reply.
  * @return int 0 if successful, otherwise a negative error code.
  */
-int coap_client_wait_and_receive(coap_client_t *client, struct coap_packet *reply, void *buf,
-                                 size_t buf_len, k_timeout_t timeout);
+int coap_client_wait_and_receive(coap_client_t *client, int request, struct coap_packet *reply,
+                                 void *buf, size_t buf_len, k_timeout_t timeout);
 
 #endif // COAP_CLIENT_H
@@ -0,0 +1,427 @@
+/*
+ * Copyright (c) 2024 Albin Hjalmas (albin@bitman.se)
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/net/coap.h>
+#include <zephyr/net/net_ip.h>
+#include <zephyr/net/socket.h>
+#include <zephyr/random/random.h>
+
+#include <errno.h>
+#include <string.h>
+
+#include "discovery.h"
+
+LOG_MODULE_REGISTER(discovery, LOG_LEVEL_INF);
+
+#define MAX_PEERS CONFIG_APP_DISCOVERY_MAX_PEERS
+#define REFRESH_MS (CONFIG_APP_DISCOVERY_REFRESH_S * MSEC_PER_SEC)
+#define RETRY_MS (CONFIG_APP_DISCOVERY_RETRY_S * MSEC_PER_SEC)
+#define TTL_MS (CONFIG_APP_DISCOVERY_TTL_S * MSEC_PER_SEC)
+#define LISTEN_MS CONFIG_APP_DISCOVERY_LISTEN_MS
+
+#define COAP_PORT 5683
+#define QUERY_SIZE 64
+#define RESPONSE_SIZE 512
+#define PRINT_PATH "/print"
+
+// Only the answers within one listen window are matched, so a short token is
+// enough, and keeps the query small.
+#define TOKEN_LEN 4
+
+typedef enum {
+    SLOT_FREE,
+    SLOT_ACTIVE, // Answered within its TTL
+    SLOT_RETIRED, // Expired. The proxy is kept until the slot is reused.
+} slot_state_t;
+
+typedef struct {
+    slot_state_t state;
+    discovery_peer_t peer;
+    bool serves_print; // The peer advertises the print resource
+    bool has_proxy; // The proxy has been started
+    server_proxy_t proxy;
+    int64_t retired_at; // Uptime (ms) when the slot was retired
+} slot_t;
+
+K_THREAD_STACK_DEFINE(discovery_thread_stack, CONFIG_APP_DISCOVERY_STACK_SIZE);
+static struct k_thread discovery_thread_data;
+
+static K_MUTEX_DEFINE(slots_lock);
+static slot_t slots[MAX_PEERS];
+static proxy_group_t *print_servers;
+
+// Only touched by the discovery thread. The message IDs and tokens are kept
+// apart from those of the CoAP clients, which share the global counter.
+static uint16_t query_id;
+static uint8_t query_token[TOKEN_LEN];
+static uint8_t response_buf[RESPONSE_SIZE];
+
+static int send_query(int sock)
+{
+    static const char *const PATH[] = { ".well-known", "core", NULL };
+
+    struct coap_packet request;
+    uint8_t data[QUERY_SIZE];
+
+    // Answers are matched on the token, so keep it for the listen window.
+    sys_rand_get(query_token, sizeof(query_token));
+
+    int rc = coap_packet_init(&request, data, sizeof(data), COAP_VERSION_1, COAP_TYPE_NON_CON,
+                              sizeof(query_token), query_token, COAP_METHOD_GET, query_id++);
+    if (rc < 0) {
+        return rc;
+    }
+
+    for (const char *const *p = PATH; *p; p++) {
+        rc = coap_packet_set_path(&request, *p);
+        if (rc < 0) {
+            return rc;
+        }
+    }
+
+    struct sockaddr_in6 dst = { .sin6_family = AF_INET6, .sin6_port = htons(COAP_PORT) };
+    net_ipv6_addr_create(&dst.sin6_addr, 0xff02, 0, 0, 0, 0, 0, 0, 0x00fd);
+
+    if (sendto(sock, request.data, request.offset, 0, (struct sockaddr *)&dst, sizeof(dst)) < 0) {
+        LOG_ERR("Failed to send discovery query: %d", errno);
+        return -errno;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Extract the target paths of a link-format (RFC 6690) document.
+ */
+static void parse_links(discovery_peer_t *peer, const uint8_t *payload, uint16_t len)
+{
+    bool quoted = false;
+
+    peer->resource_count = 0;
+
+    for (uint16_t i = 0; i < len && peer->resource_count < DISCOVERY_MAX_RESOURCES; i++) {
+        if (payload[i] == '"') {
+            quoted = !quoted;
+            continue;
+        }
+
+        // Attribute values may contain '<', so only look outside quotes.
+        if (quoted || payload[i] != '<') {
+            continue;
+        }
+
+        uint16_t start = ++i;
+        while (i < len && payload[i] != '>') {
+            i++;
+        }
+
+        // Truncated, e.g. when the document needs more than one block.
+        if (i == len) {
+            break;
+        }
+
+        size_t path_len = i - start;
+        if (path_len == 0 || path_len >= DISCOVERY_MAX_PATH_LEN) {
+            LOG_DBG("Skipping link of length %zu", path_len);
+            continue;
+        }
+
+        memcpy(peer->resources[peer->resource_count], &payload[start], path_len);
+        peer->resources[peer->resource_count][path_len] = '\0';
+        peer->resource_count++;
+    }
+}
+
+static bool serves_print(const discovery_peer_t *peer)
+{
+    for (uint8_t i = 0; i < peer->resource_count; i++) {
+        if (strcmp(peer->resources[i], PRINT_PATH) == 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * @brief Find the slot of a peer, be it active or retired.
+ *
+ * A retired slot still holds the proxy of the peer, so a peer that answers
+ * again gets its old slot back instead of a second proxy.
+ */
+static slot_t *find_slot(const struct sockaddr_in6 *addr)
+{
+    for (size_t i = 0; i < MAX_PEERS; i++) {
+        if (slots[i].state != SLOT_FREE && slots[i].peer.addr.sin6_port == addr->sin6_port &&
+            net_ipv6_addr_cmp(&slots[i].peer.addr.sin6_addr, &addr->sin6_addr)) {
+            return &slots[i];
+        }
+    }
+
+    return NULL;
+}
+
+static slot_t *alloc_slot(int64_t now)
+{
+    for (size_t i = 0; i < MAX_PEERS; i++) {
+        slot_t *slot = &slots[i];
+
+        // The proxy of a retired slot may still be queued on the transmit
+        // scheduler, so give it a full refresh period before reusing it.
+        if (slot->state == SLOT_FREE ||
+            (slot->state == SLOT_RETIRED && now - slot->retired_at >= REFRESH_MS)) {
+            if (slot->has_proxy) {
+                server_proxy_stop(&slot->proxy);
+                slot->has_proxy = false;
+            }
+
+            return slot;
+        }
+    }
+
+    return NULL;
+}
+
+static void join_group(slot_t *slot)
+{
+    char addr_str[NET_IPV6_ADDR_LEN];
+
+    net_addr_ntop(AF_INET6, &slot->peer.addr.sin6_addr, addr_str, sizeof(addr_str));
+
+    int rc = proxy_group_add(print_servers, &slot->proxy);
+    if (rc == -EALREADY) {
+        LOG_INF("Print server %s already known", addr_str);
+    } else if (rc < 0) {
+        LOG_WRN("Failed to add print server %s: %d", addr_str, rc);
+    } else {
+        LOG_INF("Print server %s available", addr_str);
+    }
+}
+
+static void start_proxy(slot_t *slot)
+{
+    char addr_str[NET_IPV6_ADDR_LEN];
+
+    net_addr_ntop(AF_INET6, &slot->peer.addr.sin6_addr, addr_str, sizeof(addr_str));
+
+    memset(&slot->proxy, 0, sizeof(slot->proxy));
+
+    int rc = server_proxy_start(&slot->proxy, addr_str, ntohs(slot->peer.addr.sin6_port));
+    if (rc < 0) {
+        LOG_ERR("Failed to start proxy for %s: %d", addr_str, rc);
+        return;
+    }
+
+    slot->has_proxy = true;
+
+    join_group(slot);
+}
+
+static void update_table(const discovery_peer_t *peer, int64_t now)
+{
+    k_mutex_lock(&slots_lock, K_FOREVER);
+
+    slot_t *slot = find_slot(&peer->addr);
+    if (slot == NULL) {
+        slot = alloc_slot(now);
+        if (slot == NULL) {
+            LOG_WRN("Peer table full, ignoring peer");
+            goto exit;
+        }
+
+        slot->state = SLOT_ACTIVE;
+        LOG_INF("Discovered peer with %u resources", peer->resource_count);
+    } else if (slot->state == SLOT_RETIRED) {
+        slot->state = SLOT_ACTIVE;
+        LOG_INF("Peer is back with %u resources", peer->resource_count);
+
+        // Its proxy was removed from the group when the slot was retired.
+        if (slot->has_proxy && serves_print(peer)) {
+            join_group(slot);
+        }
+    }
+
+    // Only the entries that answered are touched. The rest age out on their own.
+    slot->peer = *peer;
+    slot->serves_print = serves_print(peer);
+
+    if (slot->serves_print && !slot->has_proxy) {
+        start_proxy(slot);
+    }
+
+exit:
+    k_mutex_unlock(&slots_lock);
+}
+
+static void handle_response(const uint8_t *data, size_t len, const struct sockaddr_in6 *src)
+{
+    struct coap_packet reply;
+    uint8_t token[COAP_TOKEN_MAX_LEN];
+
+    if (coap_packet_parse(&reply, (uint8_t *)data, len, NULL, 0) < 0) {
+        LOG_DBG("Dropping malformed response");
+        return;
+    }
+
+    uint8_t tkl = coap_header_get_token(&reply, token);
+    if (tkl != sizeof(query_token) || memcmp(token, query_token, tkl) != 0 ||
+        coap_header_get_code(&reply) != COAP_RESPONSE_CODE_CONTENT) {
+        return;
+    }
+
+    int64_t now = k_uptime_get();
+    discovery_peer_t peer = { .addr = *src, .expires_at = now + TTL_MS };
+
+    // Honour the lifetime the peer asks for, if any.
+    struct coap_option max_age;
+    if (coap_find_options(&reply, COAP_OPTION_MAX_AGE, &max_age, 1) == 1) {
+        peer.expires_at = now + (int64_t)coap_option_value_to_int(&max_age) * MSEC_PER_SEC;
+    }
+
+    uint16_t payload_len;
+    const uint8_t *payload = coap_packet_get_payload(&reply, &payload_len);
+    if (payload != NULL) {
+        parse_links(&peer, payload, payload_len);
+    }
+
+    update_table(&peer, now);
+}
+
+static void collect_responses(int sock, int64_t deadline)
+{
+    struct pollfd fds = { .fd = sock, .events = POLLIN };
+    struct sockaddr_in6 src;
+    socklen_t addr_len;
+    int64_t remaining;
+
+    while ((remaining = deadline - k_uptime_get()) > 0) {
+        int rc = poll(&fds, 1, (int)remaining);
+        if (rc < 0) {
+            LOG_ERR("Failed to poll socket: %d", errno);
+            return;
+        }
+
+        if (rc == 0) {
+            return;
+        }
+
+        addr_len = sizeof(src);
+        ssize_t len = recvfrom(sock, response_buf, sizeof(response_buf), 0,
+                               (struct sockaddr *)&src, &addr_len);
+        if (len < 0) {
+            LOG_ERR("Failed to receive data: %d", errno);
+            return;
+        }
+
+        handle_response(response_buf, len, &src);
+    }
+}
+
+/**
+ * @brief Retire the peers that have not answered within their TTL.
+ *
+ * @return size_t The number of active peers left.
+ */
+static size_t expire(int64_t now)
+{
+    size_t active = 0;
+
+    k_mutex_lock(&slots_lock, K_FOREVER);
+
+    for (size_t i = 0; i < MAX_PEERS; i++) {
+        slot_t *slot = &slots[i];
+        if (slot->state != SLOT_ACTIVE) {
+            continue;
+        }
+
+        if (now >= slot->peer.expires_at) {
+            slot->state = SLOT_RETIRED;
+            slot->retired_at = now;
+
+            if (slot->has_proxy) {
+                proxy_group_remove(print_servers, &slot->proxy);
+            }
+
+            LOG_INF("Peer expired");
+            continue;
+        }
+
+        active++;
+    }
+
+    k_mutex_unlock(&slots_lock);
+
+    return active;
+}
+
+static void discovery_thread(void *p1, void *p2, void *p3)
+{
+    ARG_UNUSED(p2);
+    ARG_UNUSED(p3);
+
+    int sock = (int)(intptr_t)p1;
+
+    while (1) {
+        int64_t start = k_uptime_get();
+
+        if (send_query(sock) == 0) {
+            collect_responses(sock, start + LISTEN_MS);
+        }
+
+        // Query more often until a peer has answered.
+        size_t active = expire(k_uptime_get());
+        int64_t next = start + (active > 0 ? REFRESH_MS : RETRY_MS);
+
+        k_sleep(K_TIMEOUT_ABS_MS(next));
+    }
+}
+
+int discovery_start(proxy_group_t *group)
+{
+    if (group == NULL) {
+        return -EINVAL;
+    }
+
+    print_servers = group;
+
+    // Start at a random message ID, so that a reboot does not look like a
+    // retransmission to the peers.
+    query_id = (uint16_t)sys_rand32_get();
+
+    int sock = socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock < 0) {
+        LOG_ERR("Failed to create discovery socket: %d", errno);
+        return -errno;
+    }
+
+    k_thread_create(&discovery_thread_data, discovery_thread_stack,
+                    K_THREAD_STACK_SIZEOF(discovery_thread_stack), discovery_thread,
+                    (void *)(intptr_t)sock, NULL, NULL, CONFIG_APP_DISCOVERY_THREAD_PRIORITY, 0,
+                    K_NO_WAIT);
+
+    k_thread_name_set(&discovery_thread_data, "discovery");
+
+    return 0;
+}
+
+size_t discovery_get_peers(discovery_peer_t *peers, size_t max)
+{
+    size_t count = 0;
+
+    k_mutex_lock(&slots_lock, K_FOREVER);
+
+    for (size_t i = 0; i < MAX_PEERS && count < max; i++) {
+        if (slots[i].state == SLOT_ACTIVE) {
+            peers[count++] = slots[i].peer;
+        }
+    }
+
+    k_mutex_unlock(&slots_lock);
+
+    return count;
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2024 Albin Hjalmas (albin@bitman.se)
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef DISCOVERY_H
+#define DISCOVERY_H
+
+#include <zephyr/net/socket.h>
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "proxy_group.h"
+#include "server_proxy.h"
+
+#define DISCOVERY_MAX_RESOURCES 4
+#define DISCOVERY_MAX_PATH_LEN 24
+
+typedef struct {
+    struct sockaddr_in6 addr; // Address and port the peer answered from
+    int64_t expires_at; // Uptime (ms) when the entry expires unless refreshed
+    uint8_t resource_count;
+    char resources[DISCOVERY_MAX_RESOURCES][DISCOVERY_MAX_PATH_LEN]; // Advertised paths
+} discovery_peer_t;
+
+/**
+ * @brief Start the discovery thread.
+ *
+ * Periodically sends a multicast GET /.well-known/core to the all CoAP nodes
+ * address and keeps a table of the peers that answer. A server proxy is
+ * created for each peer that offers the print resource and added to the
+ * specified group. It is removed from the group once the peer has not
+ * answered for CONFIG_APP_DISCOVERY_TTL_S, and stays valid for one more
+ * refresh period so that requests already handed to it can complete.
+ *
+ * @param group The proxy group to add the discovered print servers to.
+ * @return int 0 if successful, otherwise a negative error code.
+ */
+int discovery_start(proxy_group_t *group);
+
+/**
+ * @brief Copy the table of discovered peers.
+ *
+ * @param peers Destination for the peers.
+ * @param max The number of elements in the destination.
+ * @return size_t The number of peers copied.
+ */
+size_t discovery_get_peers(discovery_peer_t *peers, size_t max);
+
+#endif // DISCOVERY_H
@@ -5,6 +5,7 @@
  */
 
 #include <zephyr/kernel.h>
+#include <zephyr/drivers/hwinfo.h>
 #include <zephyr/logging/log.h>
 #include <zephyr/sys/printk.h>
 #include <zephyr/sys/byteorder.h>
@@ -16,21 +17,56 @@
 #include <zephyr/net/udp.h>
 #include <zephyr/net/coap.h>
 #include <zephyr/net/coap_client.h>
+#include <zephyr/storage/flash_map.h>
 
 #include <errno.h>
+#include <string.h>
 
+#include "discovery.h"
+#include "mcast_pub.h"
+#include "outbound_queue.h"
+#include "proxy_group.h"
 #include "server_proxy.h"
+#include "tuning.h"
+#include "tx_scheduler.h"
 
 LOG_MODULE_REGISTER(main, LOG_LEVEL_DBG);
 
 #define PEER_PORT 5683
 #define MULTICAST_PORT 5685
-#define MESSAGE_INTERVAL K_SECONDS(1)
+#define MESSAGE_INTERVAL K_MSEC(message_interval_ms)
 
 static const uint16_t LOCAL_COAP_SERVER_PORT = 5684;
 
+#if defined(CONFIG_APP_PROXY_GROUP_POLICY_LEAST_OUTSTANDING)
+#define PRINT_SERVERS_POLICY PROXY_GROUP_LEAST_OUTSTANDING
+#elif defined(CONFIG_APP_PROXY_GROUP_POLICY_LOWEST_SRTT)
+#define PRINT_SERVERS_POLICY PROXY_GROUP_LOWEST_SRTT
+#else
+#define PRINT_SERVERS_POLICY PROXY_GROUP_ROUND_ROBIN
+#endif
+
+#if FIXED_PARTITION_EXISTS(storage_partition)
+#define BACKLOG_FLASH_AREA FIXED_PARTITION_ID(storage_partition)
+#else
+#define BACKLOG_FLASH_AREA -1
+#endif
+
+// Settings are kept in storage_partition as well, unless chosen elsewhere.
+#if defined(CONFIG_APP_OUTBOUND_QUEUE_FLASH) && defined(CONFIG_SETTINGS) &&                       \
+        !DT_HAS_CHOSEN(zephyr_settings_partition)
+#error "The backlog and the settings would share storage_partition"
+#endif
+
+static int32_t message_interval_ms = 1000; // Tunable as "app.interval_ms"
+
 static server_proxy_t server_1;
 static server_proxy_t local_server;
+static outbound_queue_t server_1_backlog;
+static proxy_group_t print_servers; // server_1 and the discovered print servers
+#ifdef CONFIG_APP_OSCORE
+static oscore_ctx_t server_1_oscore;
+#endif
 
 #include <zephyr/net/coap_service.h>
 #include <zephyr/net/net_ip.h>
@@ -138,6 +174,39 @@ static int create_multicast_socket(void)
     return sock;
 }
 
+#ifdef CONFIG_APP_OSCORE
+/**
+ * @brief Get the OSCORE Sender ID, as a hex string.
+ *
+ * Falls back to the hardware device ID when none is configured, so that the
+ * clients sharing a Master Secret do not share a Sender ID.
+ */
+static int oscore_sender_id(char *id, size_t size)
+{
+    uint8_t device_id[16];
+
+    if (strlen(CONFIG_APP_OSCORE_SENDER_ID) > 0) {
+        strncpy(id, CONFIG_APP_OSCORE_SENDER_ID, size - 1);
+        id[size - 1] = '\0';
+        return 0;
+    }
+
+    ssize_t len = hwinfo_get_device_id(device_id, sizeof(device_id));
+    if (len <= 0) {
+        LOG_ERR("No Sender ID configured and no device ID: %d", (int)len);
+        return len < 0 ? (int)len : -ENODEV;
+    }
+
+    // The trailing bytes vary the most between devices.
+    size_t id_len = MIN((size_t)len, OSCORE_MAX_ID_LEN);
+    bin2hex(&device_id[len - id_len], id_len, id, size);
+
+    LOG_INF("OSCORE Sender ID %s", id);
+
+    return 0;
+}
+#endif
+
 // static void send_multicast_message(int sock)
 // {
 //     struct sockaddr_in6 mcast_addr = {
@@ -180,13 +249,67 @@ int main(void)
         return rc;
     }
 
+#ifdef CONFIG_APP_COAPS
+    LOG_DBG("Registering CoAPS credentials");
+    rc = coap_client_add_psk(CONFIG_APP_COAPS_SEC_TAG, CONFIG_APP_COAPS_PSK,
+                             CONFIG_APP_COAPS_PSK_IDENTITY);
+    if (rc < 0) {
+        LOG_ERR("Failed to register CoAPS credentials: %d", rc);
+        return rc;
+    }
+
+    LOG_DBG("Connecting to remote CoAPS server_1");
+    rc = server_proxy_start_secure(&server_1, CONFIG_APP_SERVER_1_ADDR,
+                                   CONFIG_APP_COAPS_PEER_PORT, CONFIG_APP_COAPS_SEC_TAG);
+#elif defined(CONFIG_APP_OSCORE)
+    LOG_DBG("Deriving OSCORE context for server_1");
+    char sender_id[2 * OSCORE_MAX_ID_LEN + 1];
+    rc = oscore_sender_id(sender_id, sizeof(sender_id));
+    if (rc == 0) {
+        rc = oscore_ctx_init(&server_1_oscore, CONFIG_APP_OSCORE_MASTER_SECRET,
+                             CONFIG_APP_OSCORE_MASTER_SALT, sender_id,
+                             CONFIG_APP_OSCORE_RECIPIENT_ID);
+    }
+    if (rc < 0) {
+        LOG_ERR("Failed to derive OSCORE context: %d", rc);
+        return rc;
+    }
+
+    LOG_DBG("Connecting to remote OSCORE server_1");
+    rc = server_proxy_start(&server_1, CONFIG_APP_SERVER_1_ADDR, CONFIG_APP_OSCORE_PEER_PORT);
+    if (rc == 0) {
+        rc = coap_client_set_oscore(&server_1.client, &server_1_oscore);
+    }
+#else
     LOG_DBG("Connecting to remote CoAP server_1");
-    rc = server_proxy_start(&server_1, "2001:db8::1", PEER_PORT);
+    rc = server_proxy_start(&server_1, CONFIG_APP_SERVER_1_ADDR, PEER_PORT);
+#endif
     if (rc < 0) {
         LOG_ERR("Failed to start CoAP server_1: %d", rc);
         goto exit;
     }
 
+    LOG_DBG("Initializing server_1 backlog");
+    rc = outbound_queue_init(&server_1_backlog, BACKLOG_FLASH_AREA);
+    if (rc < 0) {
+        LOG_ERR("Failed to initialize server_1 backlog: %d", rc);
+        goto exit;
+    }
+
+    rc = server_proxy_set_backlog(&server_1, &server_1_backlog);
+    if (rc < 0) {
+        LOG_ERR("Failed to attach server_1 backlog: %d", rc);
+        goto exit;
+    }
+
+    proxy_group_init(&print_servers, PRINT_SERVERS_POLICY);
+
+    rc = proxy_group_add(&print_servers, &server_1);
+    if (rc < 0) {
+        LOG_ERR("Failed to add server_1 to print servers: %d", rc);
+        goto exit;
+    }
+
     LOG_DBG("Connecting to local CoAP server");
     rc = server_proxy_start(&local_server, "::1", LOCAL_COAP_SERVER_PORT);
     if (rc < 0) {
@@ -205,31 +328,58 @@ int main(void)
                                        .sin6_port = htons(MULTICAST_PORT),
                                        .sin6_addr = LINE_NODE_MCAST_ADDR };
 
+    LOG_DBG("Starting transmit scheduler");
+    rc = tx_scheduler_start();
+    if (rc < 0) {
+        LOG_ERR("Failed to start transmit scheduler: %d", rc);
+        goto exit;
+    }
+
+    LOG_DBG("Starting multicast publisher");
+    rc = mcast_pub_start(multicast_sock, &mcast_addr);
+    if (rc < 0) {
+        LOG_ERR("Failed to start multicast publisher: %d", rc);
+        goto exit;
+    }
+
+    tuning_param_register("app.interval_ms", &message_interval_ms, 10, 3600 * MSEC_PER_SEC,
+                          NULL);
+
+#ifdef CONFIG_APP_DISCOVERY
+    LOG_DBG("Starting print server discovery");
+    rc = discovery_start(&print_servers);
+    if (rc < 0) {
+        LOG_ERR("Failed to start discovery: %d", rc);
+        goto exit;
+    }
+#endif
+
     uint8_t payload[128] = "Hello, World! N";
 
     for (unsigned int i = 0; i < UINT32_MAX; i++) {
         sprintf(payload, "Hello, World! %d To server 1 KUK", i);
-        rc = server_proxy_print(&server_1, (const char *)payload, K_MSEC(500));
+        rc = tx_scheduler_print_group(&print_servers, (const char *)payload);
         if (rc < 0) {
-            LOG_ERR("Failed to print message to server_1: %d", rc);
+            LOG_ERR("Failed to queue message to print servers: %d", rc);
         }
 
         sprintf(payload, "Hello, World! %d To local server KUK", i);
-        rc = server_proxy_print(&local_server, (const char *)payload, K_MSEC(500));
+        rc = tx_scheduler_print(&local_server, (const char *)payload);
         if (rc < 0) {
-            LOG_ERR("Failed to print message to local server: %d", rc);
+            LOG_ERR("Failed to queue message to local server: %d", rc);
         }
 
         snprintf(payload, sizeof(payload), "Hello, World! %d", i);
-        int ret = sendto(multicast_sock, payload, strlen(payload), 0,
-                         (struct sockaddr *)&mcast_addr, sizeof(mcast_addr));
-        if (ret < 0) {
-            LOG_ERR("Failed to send multicast message: %d", errno);
+        rc = mcast_pub_publish(payload, strlen(payload));
+        if (rc == -EAGAIN) {
+            LOG_DBG("Multicast message held back by the publish rate");
+        } else if (rc < 0) {
+            LOG_ERR("Failed to queue multicast message: %d", rc);
         } else {
-            LOG_DBG("Sent multicast message: %s", payload);
+            LOG_DBG("Queued multicast message: %s", payload);
         }
 
-        k_sleep(K_SECONDS(1));
+        k_sleep(MESSAGE_INTERVAL);
     }
 
     LOG_INF("CoAP client done");
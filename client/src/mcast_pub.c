@@ -0,0 +1,260 @@
+/*
+ * Copyright (c) 2024 Albin Hjalmas (albin@bitman.se)
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/net/net_ip.h>
+#include <zephyr/net/socket.h>
+#include <zephyr/random/random.h>
+#include <zephyr/sys/byteorder.h>
+
+#include <errno.h>
+#include <string.h>
+
+#include "mcast_pub.h"
+#include "tuning.h"
+#include "tx_scheduler.h"
+
+LOG_MODULE_REGISTER(mcast_pub, LOG_LEVEL_INF);
+
+#define ADAPT_INTERVAL_MS CONFIG_APP_MCAST_PUB_ADAPT_INTERVAL_MS
+
+BUILD_ASSERT(MCAST_PUBSUB_HEADER_SIZE < CONFIG_APP_TX_SCHEDULER_PAYLOAD_SIZE,
+             "The transmit scheduler payload cannot hold a published datagram");
+
+K_THREAD_STACK_DEFINE(mcast_pub_thread_stack, CONFIG_APP_MCAST_PUB_STACK_SIZE);
+static struct k_thread mcast_pub_thread_data;
+
+// Tunable as "mcast.min_interval_ms", "mcast.max_interval_ms",
+// "mcast.loss_high_pct" and "mcast.loss_low_pct".
+static int32_t min_interval_ms = CONFIG_APP_MCAST_PUB_MIN_INTERVAL_MS;
+static int32_t max_interval_ms = CONFIG_APP_MCAST_PUB_MAX_INTERVAL_MS;
+static int32_t loss_high_pct = CONFIG_APP_MCAST_PUB_LOSS_HIGH_PCT;
+static int32_t loss_low_pct = CONFIG_APP_MCAST_PUB_LOSS_LOW_PCT;
+
+static int pub_sock = -1;
+static struct sockaddr_in6 pub_group;
+
+static K_MUTEX_DEFINE(pub_lock);
+static mcast_pub_stats_t stats;
+static uint32_t next_seq;
+static int64_t last_published = -1;
+static uint32_t window_published; // Datagrams published in the adaptation interval
+static uint32_t window_reports; // Reports received in the adaptation interval
+static uint8_t window_loss; // Worst fraction lost reported in the adaptation interval
+
+static uint32_t clamp_interval(int64_t interval)
+{
+    int32_t max = MAX(min_interval_ms, max_interval_ms);
+
+    return (uint32_t)CLAMP(interval, min_interval_ms, max);
+}
+
+/**
+ * @brief Adapt the publish rate to the loss reported in the last interval.
+ *
+ * Must be called with pub_lock held.
+ */
+static void adapt(void)
+{
+    uint32_t interval = stats.interval_ms;
+    // Loss in 1/256, compared in percent without rounding up.
+    int32_t loss_pct = (window_loss * 100) / 256;
+
+    if (window_reports == 0) {
+        // Nobody heard any of the datagrams, or nobody is listening. Either
+        // way, publishing faster would only load the channel.
+        if (window_published > 0) {
+            interval = clamp_interval((int64_t)interval * 2);
+        }
+    } else if (loss_pct > loss_high_pct) {
+        interval = clamp_interval((int64_t)interval * 2);
+    } else if (loss_pct < loss_low_pct) {
+        interval = clamp_interval((int64_t)interval - MAX(interval / 8, 1));
+    } else {
+        interval = clamp_interval(interval);
+    }
+
+    if (interval > stats.interval_ms) {
+        stats.backoffs++;
+        LOG_INF("Loss %d%% (%u reports), publish interval raised to %u ms", loss_pct,
+                window_reports, interval);
+    } else if (interval < stats.interval_ms) {
+        LOG_DBG("Loss %d%% (%u reports), publish interval lowered to %u ms", loss_pct,
+                window_reports, interval);
+    }
+
+    stats.interval_ms = interval;
+    stats.loss = window_loss;
+    window_published = 0;
+    window_reports = 0;
+    window_loss = 0;
+}
+
+static void handle_report(const uint8_t *data, ssize_t len, const struct sockaddr_in6 *src)
+{
+    if (len < MCAST_PUBSUB_REPORT_SIZE || data[0] != MCAST_PUBSUB_VERSION ||
+        data[1] != MCAST_PUBSUB_TYPE_REPORT) {
+        LOG_DBG("Ignoring datagram of %d bytes", (int)len);
+        return;
+    }
+
+    uint32_t highest = sys_get_be32(&data[2]);
+    uint8_t loss = data[6];
+    uint16_t jitter_ms = sys_get_be16(&data[7]);
+
+    LOG_DBG("Report from %s: highest %u, loss %u/256, jitter %u ms",
+            net_sprint_ipv6_addr(&src->sin6_addr), highest, loss, jitter_ms);
+
+    k_mutex_lock(&pub_lock, K_FOREVER);
+
+    stats.reports++;
+    window_reports++;
+    window_loss = MAX(window_loss, loss);
+
+    k_mutex_unlock(&pub_lock);
+}
+
+static void mcast_pub_thread(void *p1, void *p2, void *p3)
+{
+    ARG_UNUSED(p1);
+    ARG_UNUSED(p2);
+    ARG_UNUSED(p3);
+
+    struct pollfd fds = { .fd = pub_sock, .events = POLLIN };
+    uint8_t report[MCAST_PUBSUB_REPORT_SIZE];
+    struct sockaddr_in6 src;
+    socklen_t addr_len;
+    int64_t adapt_at = k_uptime_get() + ADAPT_INTERVAL_MS;
+
+    while (1) {
+        int64_t remaining = adapt_at - k_uptime_get();
+
+        if (remaining <= 0) {
+            k_mutex_lock(&pub_lock, K_FOREVER);
+            adapt();
+            k_mutex_unlock(&pub_lock);
+
+            adapt_at += ADAPT_INTERVAL_MS;
+            continue;
+        }
+
+        int rc = poll(&fds, 1, (int)remaining);
+        if (rc < 0) {
+            LOG_ERR("Failed to poll socket: %d", errno);
+            k_sleep(K_MSEC(remaining));
+            continue;
+        }
+
+        if (rc == 0) {
+            continue;
+        }
+
+        addr_len = sizeof(src);
+        ssize_t len = recvfrom(pub_sock, report, sizeof(report), 0, (struct sockaddr *)&src,
+                               &addr_len);
+        if (len < 0) {
+            LOG_ERR("Failed to receive data: %d", errno);
+            continue;
+        }
+
+        handle_report(report, len, &src);
+    }
+}
+
+static void register_tunables(void)
+{
+    tuning_param_register("mcast.min_interval_ms", &min_interval_ms, 10, 3600 * MSEC_PER_SEC,
+                          NULL);
+    tuning_param_register("mcast.max_interval_ms", &max_interval_ms, 10, 3600 * MSEC_PER_SEC,
+                          NULL);
+    tuning_param_register("mcast.loss_high_pct", &loss_high_pct, 0, 100, NULL);
+    tuning_param_register("mcast.loss_low_pct", &loss_low_pct, 0, 100, NULL);
+
+    tuning_counter_register("mcast.published", &stats.published);
+    tuning_counter_register("mcast.paced", &stats.paced);
+    tuning_counter_register("mcast.reports", &stats.reports);
+    tuning_counter_register("mcast.backoffs", &stats.backoffs);
+    tuning_counter_register("mcast.interval_ms", &stats.interval_ms);
+}
+
+int mcast_pub_start(int sock, const struct sockaddr_in6 *group)
+{
+    if (sock < 0 || group == NULL) {
+        return -EINVAL;
+    }
+
+    pub_sock = sock;
+    pub_group = *group;
+
+    register_tunables();
+
+    // Subscribers take a large jump in the sequence numbers as a restart.
+    next_seq = sys_rand32_get();
+
+    // Start at the highest rate allowed and back off from there.
+    stats.interval_ms = clamp_interval(min_interval_ms);
+
+    k_thread_create(&mcast_pub_thread_data, mcast_pub_thread_stack,
+                    K_THREAD_STACK_SIZEOF(mcast_pub_thread_stack), mcast_pub_thread, NULL, NULL,
+                    NULL, CONFIG_APP_MCAST_PUB_THREAD_PRIORITY, 0, K_NO_WAIT);
+
+    k_thread_name_set(&mcast_pub_thread_data, "mcast_pub");
+
+    return 0;
+}
+
+int mcast_pub_publish(const uint8_t *data, size_t len)
+{
+    uint8_t datagram[CONFIG_APP_TX_SCHEDULER_PAYLOAD_SIZE];
+
+    if (data == NULL) {
+        return -EINVAL;
+    }
+
+    if (pub_sock < 0) {
+        return -ENOTCONN;
+    }
+
+    if (len > sizeof(datagram) - MCAST_PUBSUB_HEADER_SIZE) {
+        return -EMSGSIZE;
+    }
+
+    k_mutex_lock(&pub_lock, K_FOREVER);
+
+    int64_t now = k_uptime_get();
+    if (last_published >= 0 && now - last_published < stats.interval_ms) {
+        stats.paced++;
+        k_mutex_unlock(&pub_lock);
+        return -EAGAIN;
+    }
+
+    datagram[0] = MCAST_PUBSUB_VERSION;
+    datagram[1] = MCAST_PUBSUB_TYPE_DATA;
+    sys_put_be32(next_seq, &datagram[2]);
+    sys_put_be32((uint32_t)now, &datagram[6]);
+    memcpy(&datagram[MCAST_PUBSUB_HEADER_SIZE], data, len);
+
+    int rc = tx_scheduler_sendto(pub_sock, &pub_group, datagram, MCAST_PUBSUB_HEADER_SIZE + len);
+    if (rc == 0) {
+        // A datagram the scheduler refused does not count as lost.
+        next_seq++;
+        last_published = now;
+        window_published++;
+        stats.published++;
+    }
+
+    k_mutex_unlock(&pub_lock);
+
+    return rc;
+}
+
+void mcast_pub_get_stats(mcast_pub_stats_t *stats_out)
+{
+    k_mutex_lock(&pub_lock, K_FOREVER);
+    *stats_out = stats;
+    k_mutex_unlock(&pub_lock);
+}
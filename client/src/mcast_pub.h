@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2024 Albin Hjalmas (albin@bitman.se)
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef MCAST_PUB_H
+#define MCAST_PUB_H
+
+#include <zephyr/net/socket.h>
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "mcast_pubsub.h"
+
+typedef struct {
+    uint32_t published; // Number of datagrams queued for transmission
+    uint32_t paced; // Number of datagrams refused to keep to the publish rate
+    uint32_t reports; // Number of subscriber reports received
+    uint32_t backoffs; // Number of times the publish rate was lowered
+    uint32_t interval_ms; // Current minimum time between two datagrams
+    uint8_t loss; // Worst fraction lost in the last adaptation interval, in 1/256
+} mcast_pub_stats_t;
+
+/**
+ * @brief Start publishing on the specified socket.
+ *
+ * Starts a thread that collects the subscriber reports arriving on the
+ * socket and adapts the publish rate to the worst loss reported: the rate is
+ * halved when the loss exceeds CONFIG_APP_MCAST_PUB_LOSS_HIGH_PCT, and
+ * raised by an eighth while it stays below CONFIG_APP_MCAST_PUB_LOSS_LOW_PCT.
+ * It is halved as well when nothing was heard after publishing for a whole
+ * adaptation interval.
+ *
+ * @param sock The socket to publish on. Must be bound.
+ * @param group The multicast group and port to publish to.
+ * @return int 0 if successful, otherwise a negative error code.
+ */
+int mcast_pub_start(int sock, const struct sockaddr_in6 *group);
+
+/**
+ * @brief Stamp a datagram and queue it to the transmit scheduler.
+ *
+ * The timestamp is taken when the datagram is queued, so the measured jitter
+ * includes the time it was held back by the transmit scheduler.
+ *
+ * @param data The payload. Copied into the queue.
+ * @param len The length of the payload.
+ * @return int 0 if successful, -EAGAIN if publishing now would exceed the
+ * publish rate, otherwise a negative error code.
+ */
+int mcast_pub_publish(const uint8_t *data, size_t len);
+
+/**
+ * @brief Get a snapshot of the publisher metrics.
+ *
+ * @param stats Destination for the metrics.
+ */
+void mcast_pub_get_stats(mcast_pub_stats_t *stats);
+
+#endif // MCAST_PUB_H
@@ -0,0 +1,23 @@
+/*
+ * Copyright (c) 2024 Albin Hjalmas (albin@bitman.se)
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef MCAST_PUBSUB_H
+#define MCAST_PUBSUB_H
+
+/*
+ * A published datagram starts with a header of version, type, sequence
+ * number (BE32) and the uptime of the publisher in ms (BE32), followed by the
+ * payload. Subscribers answer each publisher with a unicast report of
+ * version, type, highest sequence number received (BE32), fraction lost since
+ * the previous report in 1/256 and interarrival jitter in ms (BE16).
+ */
+#define MCAST_PUBSUB_VERSION 1
+#define MCAST_PUBSUB_TYPE_DATA 0
+#define MCAST_PUBSUB_TYPE_REPORT 1
+#define MCAST_PUBSUB_HEADER_SIZE 10
+#define MCAST_PUBSUB_REPORT_SIZE 9
+
+#endif // MCAST_PUBSUB_H
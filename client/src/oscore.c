@@ -0,0 +1,1083 @@
+/*
+ * Copyright (c) 2024 Albin Hjalmas (albin@bitman.se)
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/util.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef CONFIG_APP_OSCORE_SEQ_STEP
+#include <zephyr/settings/settings.h>
+#endif
+
+#include "oscore.h"
+
+LOG_MODULE_REGISTER(oscore, LOG_LEVEL_INF);
+
+#define OSCORE_ALG PSA_ALG_AEAD_WITH_SHORTENED_TAG(PSA_ALG_CCM, OSCORE_TAG_LEN)
+#define COSE_ALG_AES_CCM_16_64_128 10
+#define OSCORE_VERSION 1
+#define SEQ_MAX ((1ULL << 40) - 1)
+
+#define MAX_OPTIONS 12
+#define AAD_MAX 40
+#define STATS_LOG_INTERVAL 256
+
+// OSCORE option flag bits (RFC 8613, section 6.1).
+#define FLAG_PIV_LEN_MASK 0x07
+#define FLAG_KID 0x08
+#define FLAG_KID_CONTEXT 0x10
+#define FLAG_RESERVED 0xe0
+
+#define CBOR_UINT 0
+#define CBOR_BSTR 2
+#define CBOR_TSTR 3
+#define CBOR_ARRAY 4
+#define CBOR_NIL 0xf6
+
+#define PAYLOAD_MARKER 0xff
+
+typedef struct {
+    uint16_t num;
+    uint16_t len;
+    const uint8_t *value;
+} option_t;
+
+// Options that stay readable to proxies (class U). Everything else is
+// encrypted (class E).
+static bool is_outer(uint16_t num)
+{
+    return num == COAP_OPTION_URI_HOST || num == COAP_OPTION_URI_PORT ||
+           num == COAP_OPTION_PROXY_URI || num == COAP_OPTION_PROXY_SCHEME;
+}
+
+static size_t cbor_head(uint8_t *out, uint8_t major, uint16_t val)
+{
+    if (val < 24) {
+        out[0] = (major << 5) | val;
+        return 1;
+    }
+
+    if (val < 256) {
+        out[0] = (major << 5) | 24;
+        out[1] = val;
+        return 2;
+    }
+
+    out[0] = (major << 5) | 25;
+    sys_put_be16(val, &out[1]);
+    return 3;
+}
+
+static size_t cbor_bstr(uint8_t *out, const uint8_t *data, size_t len)
+{
+    size_t n = cbor_head(out, CBOR_BSTR, len);
+    memcpy(&out[n], data, len);
+    return n + len;
+}
+
+static int option_ext_parse(const uint8_t **p, const uint8_t *end, uint8_t nibble, uint16_t *val)
+{
+    if (nibble < 13) {
+        *val = nibble;
+        return 0;
+    }
+
+    if (nibble == 13 && *p + 1 <= end) {
+        *val = 13 + (*p)[0];
+        *p += 1;
+        return 0;
+    }
+
+    if (nibble == 14 && *p + 2 <= end) {
+        *val = 269 + sys_get_be16(*p);
+        *p += 2;
+        return 0;
+    }
+
+    return -EINVAL;
+}
+
+static size_t option_ext_encode(uint16_t val, uint8_t *nibble, uint8_t *ext)
+{
+    if (val < 13) {
+        *nibble = val;
+        return 0;
+    }
+
+    if (val < 269) {
+        *nibble = 13;
+        ext[0] = val - 13;
+        return 1;
+    }
+
+    *nibble = 14;
+    sys_put_be16(val - 269, ext);
+    return 2;
+}
+
+/**
+ * @brief Split raw CoAP options into a list and locate the payload.
+ *
+ * @return int The number of options, or a negative error code.
+ */
+static int options_parse(const uint8_t *p, const uint8_t *end, option_t *opts, size_t max,
+                         const uint8_t **payload, size_t *payload_len)
+{
+    uint16_t num = 0;
+    size_t count = 0;
+
+    *payload = NULL;
+    *payload_len = 0;
+
+    while (p < end) {
+        if (*p == PAYLOAD_MARKER) {
+            p++;
+            if (p == end) {
+                return -EINVAL;
+            }
+
+            *payload = p;
+            *payload_len = end - p;
+            break;
+        }
+
+        uint8_t delta_nibble = *p >> 4;
+        uint8_t len_nibble = *p & 0x0f;
+        uint16_t delta;
+        uint16_t len;
+
+        p++;
+
+        if (option_ext_parse(&p, end, delta_nibble, &delta) < 0 ||
+            option_ext_parse(&p, end, len_nibble, &len) < 0 || p + len > end) {
+            return -EINVAL;
+        }
+
+        if (count == max) {
+            return -ENOMEM;
+        }
+
+        num += delta;
+        opts[count].num = num;
+        opts[count].len = len;
+        opts[count].value = p;
+        count++;
+
+        p += len;
+    }
+
+    return count;
+}
+
+static int packet_options(const struct coap_packet *cpkt, option_t *opts, size_t max,
+                          const uint8_t **payload, size_t *payload_len)
+{
+    size_t hdr_len = 4 + (cpkt->data[0] & 0x0f);
+    if (hdr_len > cpkt->offset) {
+        return -EINVAL;
+    }
+
+    return options_parse(cpkt->data + hdr_len, cpkt->data + cpkt->offset, opts, max, payload,
+                         payload_len);
+}
+
+static int option_encode(uint8_t *buf, size_t size, uint16_t delta, const option_t *opt)
+{
+    uint8_t hdr[5];
+    uint8_t delta_nibble;
+    uint8_t len_nibble;
+
+    size_t n = 1;
+    n += option_ext_encode(delta, &delta_nibble, &hdr[n]);
+    n += option_ext_encode(opt->len, &len_nibble, &hdr[n]);
+    hdr[0] = (delta_nibble << 4) | len_nibble;
+
+    if (n + opt->len > size) {
+        return -ENOMEM;
+    }
+
+    memcpy(buf, hdr, n);
+    memcpy(&buf[n], opt->value, opt->len);
+
+    return n + opt->len;
+}
+
+/**
+ * @brief Build the OSCORE plaintext: code, class E options and payload.
+ *
+ * @return int The length of the plaintext, or a negative error code.
+ */
+static int plaintext_build(const struct coap_packet *cpkt, uint8_t *pt, size_t size)
+{
+    option_t opts[MAX_OPTIONS];
+    const uint8_t *payload;
+    size_t payload_len;
+
+    int count = packet_options(cpkt, opts, ARRAY_SIZE(opts), &payload, &payload_len);
+    if (count < 0) {
+        return count;
+    }
+
+    size_t off = 0;
+    uint16_t prev = 0;
+
+    pt[off++] = coap_header_get_code(cpkt);
+
+    for (int i = 0; i < count; i++) {
+        if (is_outer(opts[i].num) || opts[i].num == OSCORE_OPTION) {
+            continue;
+        }
+
+        int rc = option_encode(&pt[off], size - off, opts[i].num - prev, &opts[i]);
+        if (rc < 0) {
+            return rc;
+        }
+
+        off += rc;
+        prev = opts[i].num;
+    }
+
+    if (payload_len > 0) {
+        if (off + 1 + payload_len > size) {
+            return -ENOMEM;
+        }
+
+        pt[off++] = PAYLOAD_MARKER;
+        memcpy(&pt[off], payload, payload_len);
+        off += payload_len;
+    }
+
+    return off;
+}
+
+static int packet_init_from(struct coap_packet *out, uint8_t *buf, size_t buf_len,
+                            const struct coap_packet *src, uint8_t code)
+{
+    uint8_t token[COAP_TOKEN_MAX_LEN];
+    uint8_t tkl = coap_header_get_token(src, token);
+
+    return coap_packet_init(out, buf, buf_len, COAP_VERSION_1, coap_header_get_type(src), tkl,
+                            token, code, coap_header_get_id(src));
+}
+
+/**
+ * @brief Build the outer message: class U options, the OSCORE option and the ciphertext.
+ */
+static int outer_build(const struct coap_packet *src, uint8_t code, const uint8_t *oscore_value,
+                       size_t oscore_len, const uint8_t *ciphertext, size_t ct_len, uint8_t *buf,
+                       size_t buf_len, struct coap_packet *out)
+{
+    option_t opts[MAX_OPTIONS];
+    const uint8_t *payload;
+    size_t payload_len;
+
+    int count = packet_options(src, opts, ARRAY_SIZE(opts), &payload, &payload_len);
+    if (count < 0) {
+        return count;
+    }
+
+    int rc = packet_init_from(out, buf, buf_len, src, code);
+    if (rc < 0) {
+        return rc;
+    }
+
+    bool oscore_added = false;
+
+    for (int i = 0; i < count && rc == 0; i++) {
+        if (!is_outer(opts[i].num)) {
+            continue;
+        }
+
+        if (!oscore_added && opts[i].num > OSCORE_OPTION) {
+            rc = coap_packet_append_option(out, OSCORE_OPTION, oscore_value, oscore_len);
+            oscore_added = true;
+        }
+
+        if (rc == 0) {
+            rc = coap_packet_append_option(out, opts[i].num, opts[i].value, opts[i].len);
+        }
+    }
+
+    if (rc == 0 && !oscore_added) {
+        rc = coap_packet_append_option(out, OSCORE_OPTION, oscore_value, oscore_len);
+    }
+
+    if (rc == 0) {
+        rc = coap_packet_append_payload_marker(out);
+    }
+
+    if (rc == 0) {
+        rc = coap_packet_append_payload(out, ciphertext, ct_len);
+    }
+
+    return rc;
+}
+
+/**
+ * @brief Rebuild the plain message from the outer options and the decrypted plaintext.
+ */
+static int inner_build(const struct coap_packet *src, const uint8_t *pt, size_t pt_len,
+                       uint8_t *buf, size_t buf_len, struct coap_packet *out)
+{
+    option_t outer[MAX_OPTIONS];
+    option_t inner[MAX_OPTIONS];
+    const uint8_t *payload;
+    size_t payload_len;
+
+    int outer_count = packet_options(src, outer, ARRAY_SIZE(outer), &payload, &payload_len);
+    if (outer_count < 0) {
+        return outer_count;
+    }
+
+    int inner_count = options_parse(&pt[1], &pt[pt_len], inner, ARRAY_SIZE(inner), &payload,
+                                    &payload_len);
+    if (inner_count < 0) {
+        return inner_count;
+    }
+
+    int rc = packet_init_from(out, buf, buf_len, src, pt[0]);
+    if (rc < 0) {
+        return rc;
+    }
+
+    // Both lists are sorted by option number. Merge them, keeping only the
+    // class U options of the outer message.
+    int i = 0;
+    int j = 0;
+
+    while (rc == 0 && (i < outer_count || j < inner_count)) {
+        if (i < outer_count && !is_outer(outer[i].num)) {
+            i++;
+            continue;
+        }
+
+        const option_t *opt;
+        if (j == inner_count || (i < outer_count && outer[i].num <= inner[j].num)) {
+            opt = &outer[i++];
+        } else {
+            opt = &inner[j++];
+        }
+
+        rc = coap_packet_append_option(out, opt->num, opt->value, opt->len);
+    }
+
+    if (rc == 0 && payload_len > 0) {
+        rc = coap_packet_append_payload_marker(out);
+        if (rc == 0) {
+            rc = coap_packet_append_payload(out, payload, payload_len);
+        }
+    }
+
+    if (rc < 0) {
+        return rc;
+    }
+
+    // Parse the result so that it can be handled like a received packet.
+    return coap_packet_parse(out, buf, out->offset, NULL, 0);
+}
+
+static const option_t *option_find(const option_t *opts, int count, uint16_t num)
+{
+    for (int i = 0; i < count; i++) {
+        if (opts[i].num == num) {
+            return &opts[i];
+        }
+    }
+
+    return NULL;
+}
+
+static size_t aad_build(const oscore_request_t *binding, uint8_t *aad)
+{
+    uint8_t external[AAD_MAX];
+    size_t n = 0;
+
+    // external_aad = [ oscore_version, [ alg_aead ], request_kid, request_piv, options ]
+    n += cbor_head(&external[n], CBOR_ARRAY, 5);
+    n += cbor_head(&external[n], CBOR_UINT, OSCORE_VERSION);
+    n += cbor_head(&external[n], CBOR_ARRAY, 1);
+    n += cbor_head(&external[n], CBOR_UINT, COSE_ALG_AES_CCM_16_64_128);
+    n += cbor_bstr(&external[n], binding->kid, binding->kid_len);
+    n += cbor_bstr(&external[n], binding->piv, binding->piv_len);
+    n += cbor_head(&external[n], CBOR_BSTR, 0);
+
+    // Enc_structure = [ "Encrypt0", h'', external_aad ]
+    size_t m = 0;
+    m += cbor_head(&aad[m], CBOR_ARRAY, 3);
+    m += cbor_head(&aad[m], CBOR_TSTR, 8);
+    memcpy(&aad[m], "Encrypt0", 8);
+    m += 8;
+    m += cbor_head(&aad[m], CBOR_BSTR, 0);
+    m += cbor_bstr(&aad[m], external, n);
+
+    return m;
+}
+
+static void nonce_base_init(oscore_endpoint_t *endpoint, const uint8_t *common_iv)
+{
+    memset(endpoint->nonce_base, 0, sizeof(endpoint->nonce_base));
+    endpoint->nonce_base[0] = endpoint->id_len;
+    memcpy(&endpoint->nonce_base[1 + OSCORE_MAX_ID_LEN - endpoint->id_len], endpoint->id,
+           endpoint->id_len);
+
+    for (size_t i = 0; i < OSCORE_NONCE_LEN; i++) {
+        endpoint->nonce_base[i] ^= common_iv[i];
+    }
+}
+
+static void nonce_make(const oscore_endpoint_t *endpoint, oscore_request_t *binding)
+{
+    memcpy(binding->nonce, endpoint->nonce_base, OSCORE_NONCE_LEN);
+
+    for (size_t i = 0; i < binding->piv_len; i++) {
+        binding->nonce[OSCORE_NONCE_LEN - binding->piv_len + i] ^= binding->piv[i];
+    }
+}
+
+#ifdef CONFIG_APP_OSCORE_SEQ_STEP
+static size_t piv_encode(uint64_t seq, uint8_t *piv)
+{
+    size_t len = 0;
+    uint64_t rest = seq;
+
+    // Minimal big-endian encoding. Zero is encoded as a single zero byte.
+    do {
+        len++;
+        rest >>= 8;
+    } while (rest != 0);
+
+    for (size_t i = 0; i < len; i++) {
+        piv[len - 1 - i] = (seq >> (8 * i)) & 0xff;
+    }
+
+    return len;
+}
+
+static uint64_t piv_decode(const uint8_t *piv, size_t len)
+{
+    uint64_t seq = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        seq = (seq << 8) | piv[i];
+    }
+
+    return seq;
+}
+
+static bool replay_check(const oscore_ctx_t *ctx, uint64_t seq)
+{
+    if (!ctx->replay_valid || seq > ctx->replay_top) {
+        return true;
+    }
+
+    uint64_t age = ctx->replay_top - seq;
+    return age < OSCORE_REPLAY_WINDOW && !(ctx->replay_bitmap & BIT(age));
+}
+
+static void replay_update(oscore_ctx_t *ctx, uint64_t seq)
+{
+    if (!ctx->replay_valid) {
+        ctx->replay_valid = true;
+        ctx->replay_top = seq;
+        ctx->replay_bitmap = 1;
+        return;
+    }
+
+    if (seq > ctx->replay_top) {
+        uint64_t shift = seq - ctx->replay_top;
+        ctx->replay_bitmap = shift >= OSCORE_REPLAY_WINDOW ? 1 : (ctx->replay_bitmap << shift) | 1;
+        ctx->replay_top = seq;
+    } else {
+        ctx->replay_bitmap |= BIT(ctx->replay_top - seq);
+    }
+}
+
+/**
+ * @brief Decode the value of an OSCORE option.
+ *
+ * Fills in the Partial IV and kid of the binding, leaving the fields that are
+ * absent from the option untouched.
+ */
+static int option_value_decode(const option_t *opt, oscore_request_t *binding)
+{
+    if (opt->len == 0) {
+        return 0;
+    }
+
+    const uint8_t *p = opt->value;
+    const uint8_t *end = opt->value + opt->len;
+    uint8_t flags = *p++;
+    size_t piv_len = flags & FLAG_PIV_LEN_MASK;
+
+    if ((flags & FLAG_RESERVED) || piv_len > OSCORE_MAX_PIV_LEN || p + piv_len > end) {
+        return -EBADMSG;
+    }
+
+    if (piv_len > 0) {
+        memcpy(binding->piv, p, piv_len);
+        binding->piv_len = piv_len;
+        p += piv_len;
+    }
+
+    if (flags & FLAG_KID_CONTEXT) {
+        // ID Context is not supported. Skip it, the kid lookup will fail.
+        if (p == end || p + 1 + *p > end) {
+            return -EBADMSG;
+        }
+        p += 1 + *p;
+    }
+
+    if (flags & FLAG_KID) {
+        if (end - p > OSCORE_MAX_ID_LEN) {
+            return -EPERM;
+        }
+
+        memcpy(binding->kid, p, end - p);
+        binding->kid_len = end - p;
+    }
+
+    return 0;
+}
+
+static size_t option_value_encode(const oscore_request_t *binding, uint8_t *value)
+{
+    size_t n = 0;
+
+    value[n++] = binding->piv_len | FLAG_KID;
+    memcpy(&value[n], binding->piv, binding->piv_len);
+    n += binding->piv_len;
+    memcpy(&value[n], binding->kid, binding->kid_len);
+    n += binding->kid_len;
+
+    return n;
+}
+#endif // CONFIG_APP_OSCORE_SEQ_STEP
+
+static void stats_update(oscore_ctx_t *ctx, bool protect, uint32_t start)
+{
+    uint32_t cycles = k_cycle_get_32() - start;
+
+    if (protect) {
+        ctx->stats.protected++;
+        ctx->stats.protect_cycles += cycles;
+    } else {
+        ctx->stats.unprotected++;
+        ctx->stats.unprotect_cycles += cycles;
+    }
+
+    uint32_t ops = ctx->stats.protected + ctx->stats.unprotected;
+    if (ops % STATS_LOG_INTERVAL == 0) {
+        uint32_t protect_us = ctx->stats.protected ?
+                                      k_cyc_to_us_floor64(ctx->stats.protect_cycles) /
+                                              ctx->stats.protected :
+                                      0;
+        uint32_t unprotect_us = ctx->stats.unprotected ?
+                                        k_cyc_to_us_floor64(ctx->stats.unprotect_cycles) /
+                                                ctx->stats.unprotected :
+                                        0;
+
+        LOG_INF("protect %u (avg %u us), unprotect %u (avg %u us), rejected %u",
+                ctx->stats.protected, protect_us, ctx->stats.unprotected, unprotect_us,
+                ctx->stats.rejected);
+    }
+}
+
+static int hkdf(const uint8_t *salt, size_t salt_len, const uint8_t *secret, size_t secret_len,
+                const uint8_t *info, size_t info_len, uint8_t *out, size_t out_len)
+{
+    psa_key_derivation_operation_t op = PSA_KEY_DERIVATION_OPERATION_INIT;
+    psa_status_t status;
+
+    status = psa_key_derivation_setup(&op, PSA_ALG_HKDF(PSA_ALG_SHA_256));
+    if (status == PSA_SUCCESS) {
+        status = psa_key_derivation_input_bytes(&op, PSA_KEY_DERIVATION_INPUT_SALT, salt,
+                                                salt_len);
+    }
+    if (status == PSA_SUCCESS) {
+        status = psa_key_derivation_input_bytes(&op, PSA_KEY_DERIVATION_INPUT_SECRET, secret,
+                                                secret_len);
+    }
+    if (status == PSA_SUCCESS) {
+        status = psa_key_derivation_input_bytes(&op, PSA_KEY_DERIVATION_INPUT_INFO, info,
+                                                info_len);
+    }
+    if (status == PSA_SUCCESS) {
+        status = psa_key_derivation_output_bytes(&op, out, out_len);
+    }
+
+    psa_key_derivation_abort(&op);
+
+    return status == PSA_SUCCESS ? 0 : -EIO;
+}
+
+/**
+ * @brief Derive a key or the Common IV (RFC 8613, section 3.2.1).
+ */
+static int derive(const uint8_t *secret, size_t secret_len, const uint8_t *salt, size_t salt_len,
+                  const uint8_t *id, size_t id_len, const char *type, uint8_t *out,
+                  size_t out_len)
+{
+    uint8_t info[32];
+    size_t type_len = strlen(type);
+    size_t n = 0;
+
+    // info = [ id, id_context, alg_aead, type, L ]
+    n += cbor_head(&info[n], CBOR_ARRAY, 5);
+    n += cbor_bstr(&info[n], id, id_len);
+    info[n++] = CBOR_NIL;
+    n += cbor_head(&info[n], CBOR_UINT, COSE_ALG_AES_CCM_16_64_128);
+    n += cbor_head(&info[n], CBOR_TSTR, type_len);
+    memcpy(&info[n], type, type_len);
+    n += type_len;
+    n += cbor_head(&info[n], CBOR_UINT, out_len);
+
+    return hkdf(salt, salt_len, secret, secret_len, info, n, out, out_len);
+}
+
+static int endpoint_init(oscore_endpoint_t *endpoint, const char *id_hex, const uint8_t *secret,
+                         size_t secret_len, const uint8_t *salt, size_t salt_len,
+                         psa_key_usage_t usage)
+{
+    size_t id_hex_len = strlen(id_hex);
+    if (id_hex_len > 2 * OSCORE_MAX_ID_LEN) {
+        return -EINVAL;
+    }
+
+    endpoint->id_len = hex2bin(id_hex, id_hex_len, endpoint->id, sizeof(endpoint->id));
+    if (endpoint->id_len * 2 != id_hex_len) {
+        return -EINVAL;
+    }
+
+    uint8_t key[OSCORE_KEY_LEN];
+    int rc = derive(secret, secret_len, salt, salt_len, endpoint->id, endpoint->id_len, "Key",
+                    key, sizeof(key));
+    if (rc < 0) {
+        return rc;
+    }
+
+    psa_key_attributes_t attributes = PSA_KEY_ATTRIBUTES_INIT;
+    psa_set_key_usage_flags(&attributes, usage);
+    psa_set_key_algorithm(&attributes, OSCORE_ALG);
+    psa_set_key_type(&attributes, PSA_KEY_TYPE_AES);
+    psa_set_key_bits(&attributes, OSCORE_KEY_LEN * 8);
+
+    psa_status_t status = psa_import_key(&attributes, key, sizeof(key), &endpoint->key);
+    memset(key, 0, sizeof(key));
+
+    return status == PSA_SUCCESS ? 0 : -EIO;
+}
+
+#ifdef CONFIG_APP_OSCORE_SEQ_STEP
+static int seq_read(const char *key, size_t len, settings_read_cb read_cb, void *cb_arg,
+                    void *param)
+{
+    uint64_t *bound = param;
+
+    if (len != sizeof(*bound) || read_cb(cb_arg, bound, sizeof(*bound)) != sizeof(*bound)) {
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Continue from the bound on the sequence numbers stored by an earlier run.
+ */
+static int seq_load(oscore_ctx_t *ctx)
+{
+    uint64_t bound = 0;
+
+    int rc = settings_subsys_init();
+    if (rc == 0) {
+        rc = settings_load_subtree_direct(ctx->seq_key, seq_read, &bound);
+    }
+
+    if (rc < 0) {
+        LOG_ERR("Failed to load the sequence number: %d", rc);
+        return rc;
+    }
+
+    // Every sequence number below the bound may have been used already.
+    ctx->sender_seq = bound;
+    ctx->seq_limit = bound;
+
+    LOG_INF("Sequence numbers continue at %u", (uint32_t)bound);
+
+    return 0;
+}
+
+/**
+ * @brief Store a new bound before the sequence number reaches the stored one.
+ */
+static int seq_reserve(oscore_ctx_t *ctx)
+{
+    if (ctx->sender_seq < ctx->seq_limit) {
+        return 0;
+    }
+
+    uint64_t bound = ctx->sender_seq + CONFIG_APP_OSCORE_SEQ_STEP;
+
+    int rc = settings_save_one(ctx->seq_key, &bound, sizeof(bound));
+    if (rc < 0) {
+        LOG_ERR("Failed to store the sequence number: %d", rc);
+        return -EIO;
+    }
+
+    ctx->seq_limit = bound;
+
+    return 0;
+}
+#endif // CONFIG_APP_OSCORE_SEQ_STEP
+
+int oscore_ctx_init(oscore_ctx_t *ctx, const char *master_secret, const char *master_salt,
+                    const char *sender_id, const char *recipient_id)
+{
+    if (ctx == NULL || master_secret == NULL || master_salt == NULL || sender_id == NULL ||
+        recipient_id == NULL) {
+        return -EINVAL;
+    }
+
+    uint8_t secret[32];
+    uint8_t salt[16];
+    uint8_t common_iv[OSCORE_NONCE_LEN];
+
+    memset(ctx, 0, sizeof(*ctx));
+
+    size_t secret_len = hex2bin(master_secret, strlen(master_secret), secret, sizeof(secret));
+    size_t salt_len = hex2bin(master_salt, strlen(master_salt), salt, sizeof(salt));
+    if (secret_len == 0 || salt_len * 2 != strlen(master_salt)) {
+        LOG_ERR("Invalid master secret or salt");
+        return -EINVAL;
+    }
+
+    if (psa_crypto_init() != PSA_SUCCESS) {
+        LOG_ERR("Failed to initialize PSA crypto");
+        return -EIO;
+    }
+
+    int rc = endpoint_init(&ctx->sender, sender_id, secret, secret_len, salt, salt_len,
+                           PSA_KEY_USAGE_ENCRYPT);
+    if (rc == 0) {
+        rc = endpoint_init(&ctx->recipient, recipient_id, secret, secret_len, salt, salt_len,
+                           PSA_KEY_USAGE_DECRYPT);
+    }
+    if (rc == 0) {
+        rc = derive(secret, secret_len, salt, salt_len, NULL, 0, "IV", common_iv,
+                    sizeof(common_iv));
+    }
+
+    memset(secret, 0, sizeof(secret));
+
+    if (rc < 0) {
+        LOG_ERR("Failed to derive security context: %d", rc);
+        return rc;
+    }
+
+    nonce_base_init(&ctx->sender, common_iv);
+    nonce_base_init(&ctx->recipient, common_iv);
+
+    snprintf(ctx->seq_key, sizeof(ctx->seq_key), "oscore/s%s", sender_id);
+
+#ifdef CONFIG_APP_OSCORE_SEQ_STEP
+    rc = seq_load(ctx);
+    if (rc < 0) {
+        oscore_ctx_free(ctx);
+        return rc;
+    }
+#endif
+
+    LOG_INF("Security context derived");
+
+    return 0;
+}
+
+void oscore_ctx_free(oscore_ctx_t *ctx)
+{
+    if (ctx == NULL) {
+        return;
+    }
+
+    psa_destroy_key(ctx->sender.key);
+    psa_destroy_key(ctx->recipient.key);
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+static int protect(oscore_ctx_t *ctx, const oscore_request_t *binding, const uint8_t *nonce,
+                   const struct coap_packet *plain, uint8_t code, const uint8_t *oscore_value,
+                   size_t oscore_len, uint8_t *buf, size_t buf_len, struct coap_packet *out)
+{
+    uint8_t pt[OSCORE_MAX_MESSAGE];
+    uint8_t ct[OSCORE_MAX_MESSAGE + OSCORE_TAG_LEN];
+    uint8_t aad[AAD_MAX];
+    size_t ct_len;
+
+    int pt_len = plaintext_build(plain, pt, sizeof(pt));
+    if (pt_len < 0) {
+        return pt_len;
+    }
+
+    size_t aad_len = aad_build(binding, aad);
+
+    psa_status_t status = psa_aead_encrypt(ctx->sender.key, OSCORE_ALG, nonce, OSCORE_NONCE_LEN,
+                                           aad, aad_len, pt, pt_len, ct, sizeof(ct), &ct_len);
+    if (status != PSA_SUCCESS) {
+        LOG_ERR("Encryption failed: %d", status);
+        return -EIO;
+    }
+
+    return outer_build(plain, code, oscore_value, oscore_len, ct, ct_len, buf, buf_len, out);
+}
+
+static int unprotect(oscore_ctx_t *ctx, const oscore_request_t *binding, const uint8_t *nonce,
+                     const struct coap_packet *protected, const uint8_t *ciphertext,
+                     size_t ct_len, uint8_t *buf, size_t buf_len, struct coap_packet *out)
+{
+    uint8_t pt[OSCORE_MAX_MESSAGE];
+    uint8_t aad[AAD_MAX];
+    size_t pt_len;
+
+    size_t aad_len = aad_build(binding, aad);
+
+    psa_status_t status = psa_aead_decrypt(ctx->recipient.key, OSCORE_ALG, nonce,
+                                           OSCORE_NONCE_LEN, aad, aad_len, ciphertext, ct_len,
+                                           pt, sizeof(pt), &pt_len);
+    if (status != PSA_SUCCESS || pt_len == 0) {
+        return -EBADMSG;
+    }
+
+    return inner_build(protected, pt, pt_len, buf, buf_len, out);
+}
+
+#ifdef CONFIG_APP_OSCORE_SEQ_STEP
+int oscore_protect_request(oscore_ctx_t *ctx, const struct coap_packet *request, uint8_t *buf,
+                           size_t buf_len, struct coap_packet *out, oscore_request_t *binding)
+{
+    if (ctx == NULL || request == NULL || buf == NULL || out == NULL || binding == NULL) {
+        return -EINVAL;
+    }
+
+    uint32_t start = k_cycle_get_32();
+
+    if (ctx->sender_seq > SEQ_MAX) {
+        LOG_ERR("Sequence numbers exhausted, a new security context is needed");
+        return -EOVERFLOW;
+    }
+
+    int rc = seq_reserve(ctx);
+    if (rc < 0) {
+        return rc;
+    }
+
+    binding->piv_len = piv_encode(ctx->sender_seq++, binding->piv);
+    memcpy(binding->kid, ctx->sender.id, ctx->sender.id_len);
+    binding->kid_len = ctx->sender.id_len;
+    nonce_make(&ctx->sender, binding);
+
+    uint8_t value[1 + OSCORE_MAX_PIV_LEN + OSCORE_MAX_ID_LEN];
+    size_t value_len = option_value_encode(binding, value);
+
+    rc = protect(ctx, binding, binding->nonce, request, COAP_METHOD_POST, value, value_len, buf,
+                 buf_len, out);
+    if (rc < 0) {
+        return rc;
+    }
+
+    stats_update(ctx, true, start);
+    return 0;
+}
+#endif // CONFIG_APP_OSCORE_SEQ_STEP
+
+int oscore_request_kid(const struct coap_packet *request, uint8_t *kid, uint8_t *kid_len)
+{
+    if (request == NULL || kid == NULL || kid_len == NULL) {
+        return -EINVAL;
+    }
+
+    oscore_request_t received = { 0 };
+    option_t opts[MAX_OPTIONS];
+    const uint8_t *ciphertext;
+    size_t ct_len;
+
+    int count = packet_options(request, opts, ARRAY_SIZE(opts), &ciphertext, &ct_len);
+    if (count < 0) {
+        return count;
+    }
+
+    const option_t *opt = option_find(opts, count, OSCORE_OPTION);
+    if (opt == NULL) {
+        return -EBADMSG;
+    }
+
+    int rc = option_value_decode(opt, &received);
+    if (rc < 0) {
+        return rc;
+    }
+
+    if (received.kid_len == 0) {
+        return -EBADMSG;
+    }
+
+    memcpy(kid, received.kid, received.kid_len);
+    *kid_len = received.kid_len;
+
+    return 0;
+}
+
+int oscore_unprotect_request(oscore_ctx_t *ctx, const struct coap_packet *request, uint8_t *buf,
+                             size_t buf_len, struct coap_packet *out, oscore_request_t *binding)
+{
+    if (ctx == NULL || request == NULL || buf == NULL || out == NULL || binding == NULL) {
+        return -EINVAL;
+    }
+
+    uint32_t start = k_cycle_get_32();
+    oscore_request_t received = { 0 };
+    option_t opts[MAX_OPTIONS];
+    const uint8_t *ciphertext;
+    size_t ct_len;
+    int rc;
+
+    int count = packet_options(request, opts, ARRAY_SIZE(opts), &ciphertext, &ct_len);
+    if (count < 0) {
+        return count;
+    }
+
+    const option_t *opt = option_find(opts, count, OSCORE_OPTION);
+    if (opt == NULL || ciphertext == NULL) {
+        return -EBADMSG;
+    }
+
+    rc = option_value_decode(opt, &received);
+    if (rc < 0) {
+        goto reject;
+    }
+
+    // A request must carry a Partial IV and identify our recipient context.
+    if (received.piv_len == 0 || received.kid_len != ctx->recipient.id_len ||
+        memcmp(received.kid, ctx->recipient.id, received.kid_len) != 0) {
+        rc = -EPERM;
+        goto reject;
+    }
+
+    uint64_t seq = piv_decode(received.piv, received.piv_len);
+    if (!replay_check(ctx, seq)) {
+        LOG_WRN("Replayed request %u rejected", (uint32_t)seq);
+        rc = -EPERM;
+        goto reject;
+    }
+
+    nonce_make(&ctx->recipient, &received);
+
+    rc = unprotect(ctx, &received, received.nonce, request, ciphertext, ct_len, buf, buf_len,
+                   out);
+    if (rc < 0) {
+        goto reject;
+    }
+
+    // Only a verified request may advance the replay window.
+    replay_update(ctx, seq);
+    *binding = received;
+    stats_update(ctx, false, start);
+    return 0;
+
+reject:
+    ctx->stats.rejected++;
+    return rc;
+}
+
+int oscore_protect_response(oscore_ctx_t *ctx, const oscore_request_t *binding,
+                            const struct coap_packet *response, uint8_t *buf, size_t buf_len,
+                            struct coap_packet *out)
+{
+    if (ctx == NULL || binding == NULL || response == NULL || buf == NULL || out == NULL) {
+        return -EINVAL;
+    }
+
+    uint32_t start = k_cycle_get_32();
+
+    // The response reuses the nonce of the request, so the OSCORE option is empty.
+    int rc = protect(ctx, binding, binding->nonce, response, COAP_RESPONSE_CODE_CHANGED, NULL, 0,
+                     buf, buf_len, out);
+    if (rc < 0) {
+        return rc;
+    }
+
+    stats_update(ctx, true, start);
+    return 0;
+}
+
+int oscore_unprotect_response(oscore_ctx_t *ctx, const oscore_request_t *binding,
+                              const struct coap_packet *response, uint8_t *buf, size_t buf_len,
+                              struct coap_packet *out)
+{
+    if (ctx == NULL || binding == NULL || response == NULL || buf == NULL || out == NULL) {
+        return -EINVAL;
+    }
+
+    uint32_t start = k_cycle_get_32();
+    option_t opts[MAX_OPTIONS];
+    const uint8_t *ciphertext;
+    size_t ct_len;
+
+    int count = packet_options(response, opts, ARRAY_SIZE(opts), &ciphertext, &ct_len);
+    if (count < 0) {
+        return count;
+    }
+
+    // Error responses from the OSCORE layer of the peer are not protected.
+    const option_t *opt = option_find(opts, count, OSCORE_OPTION);
+    if (opt == NULL || ciphertext == NULL) {
+        ctx->stats.rejected++;
+        return -EACCES;
+    }
+
+    const uint8_t *nonce = binding->nonce;
+    oscore_request_t response_binding = *binding;
+
+    // A response may carry its own Partial IV, generated by the peer.
+    if (opt->len > 0) {
+        response_binding.piv_len = 0;
+
+        int rc = option_value_decode(opt, &response_binding);
+        if (rc < 0) {
+            ctx->stats.rejected++;
+            return rc;
+        }
+
+        if (response_binding.piv_len > 0) {
+            oscore_request_t nonce_binding = response_binding;
+            nonce_make(&ctx->recipient, &nonce_binding);
+            memcpy(response_binding.nonce, nonce_binding.nonce, OSCORE_NONCE_LEN);
+            nonce = response_binding.nonce;
+        }
+
+        // The AAD always refers to the request.
+        memcpy(response_binding.kid, binding->kid, binding->kid_len);
+        response_binding.kid_len = binding->kid_len;
+        memcpy(response_binding.piv, binding->piv, binding->piv_len);
+        response_binding.piv_len = binding->piv_len;
+    }
+
+    int rc = unprotect(ctx, &response_binding, nonce, response, ciphertext, ct_len, buf, buf_len,
+                       out);
+    if (rc < 0) {
+        ctx->stats.rejected++;
+        return rc;
+    }
+
+    stats_update(ctx, false, start);
+    return 0;
+}
+
+void oscore_get_stats(const oscore_ctx_t *ctx, oscore_stats_t *stats)
+{
+    *stats = ctx->stats;
+}
@@ -0,0 +1,193 @@
+/*
+ * Copyright (c) 2024 Albin Hjalmas (albin@bitman.se)
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef OSCORE_H
+#define OSCORE_H
+
+#include <zephyr/net/coap.h>
+
+#include <psa/crypto.h>
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define OSCORE_OPTION 9 // CoAP option number of the OSCORE option
+#define OSCORE_KEY_LEN 16 // AES-CCM-16-64-128
+#define OSCORE_TAG_LEN 8
+#define OSCORE_NONCE_LEN 13
+#define OSCORE_MAX_ID_LEN (OSCORE_NONCE_LEN - 6)
+#define OSCORE_MAX_PIV_LEN 5
+#define OSCORE_REPLAY_WINDOW 32
+#define OSCORE_SEQ_KEY_LEN (sizeof("oscore/s") + 2 * OSCORE_MAX_ID_LEN)
+
+/** Largest message, protected or not, handled by the OSCORE layer. */
+#define OSCORE_MAX_MESSAGE 256
+
+/** Upper bound on the bytes protection adds to a message (option and tag). */
+#define OSCORE_MAX_OVERHEAD (1 + 2 + 1 + OSCORE_MAX_PIV_LEN + OSCORE_MAX_ID_LEN + OSCORE_TAG_LEN)
+
+typedef struct {
+    uint8_t id[OSCORE_MAX_ID_LEN];
+    uint8_t id_len;
+    psa_key_id_t key; // Imported once when the context is derived
+    uint8_t nonce_base[OSCORE_NONCE_LEN]; // Common IV XOR the ID part of the nonce
+} oscore_endpoint_t;
+
+typedef struct {
+    uint32_t protected; // Number of messages protected
+    uint32_t unprotected; // Number of messages verified and decrypted
+    uint32_t rejected; // Number of messages that failed verification or were replayed
+    uint64_t protect_cycles; // Accumulated cycles spent protecting
+    uint64_t unprotect_cycles; // Accumulated cycles spent unprotecting
+} oscore_stats_t;
+
+/**
+ * @brief OSCORE security context (RFC 8613).
+ *
+ * Keys and nonce prefixes are derived once, so that protecting a message only
+ * costs the AEAD operation and some bookkeeping.
+ */
+typedef struct {
+    oscore_endpoint_t sender;
+    oscore_endpoint_t recipient;
+    uint64_t sender_seq; // Next Partial IV to use
+    uint64_t seq_limit; // Stored bound on the Partial IVs used, see oscore_protect_request()
+    char seq_key[OSCORE_SEQ_KEY_LEN]; // Settings key of the stored bound
+    uint64_t replay_top; // Highest sequence number received
+    uint32_t replay_bitmap; // Bit n set if replay_top - n has been received
+    bool replay_valid; // Anything has been received yet
+    oscore_stats_t stats;
+} oscore_ctx_t;
+
+/** Request parameters that the corresponding response is bound to. */
+typedef struct {
+    uint8_t kid[OSCORE_MAX_ID_LEN];
+    uint8_t kid_len;
+    uint8_t piv[OSCORE_MAX_PIV_LEN];
+    uint8_t piv_len;
+    uint8_t nonce[OSCORE_NONCE_LEN];
+} oscore_request_t;
+
+/**
+ * @brief Derive an OSCORE security context.
+ *
+ * Uses AES-CCM-16-64-128 and HKDF-SHA-256 without ID Context. With
+ * CONFIG_APP_OSCORE_SEQ_STEP, the sender sequence number continues from the
+ * bound stored by an earlier run under "oscore/s<sender_id>".
+ *
+ * @param ctx The context to derive.
+ * @param master_secret The Master Secret, as a hex string.
+ * @param master_salt The Master Salt, as a hex string. May be empty.
+ * @param sender_id The Sender ID, as a hex string. May be empty.
+ * @param recipient_id The Recipient ID, as a hex string. May be empty.
+ * @return int 0 if successful, otherwise a negative error code.
+ */
+int oscore_ctx_init(oscore_ctx_t *ctx, const char *master_secret, const char *master_salt,
+                    const char *sender_id, const char *recipient_id);
+
+/**
+ * @brief Release the keys of a security context.
+ *
+ * @param ctx The context to release.
+ */
+void oscore_ctx_free(oscore_ctx_t *ctx);
+
+/**
+ * @brief Get the kid of a protected request, without verifying it.
+ *
+ * Used to select the security context to verify the request with.
+ *
+ * @param request The protected request.
+ * @param kid Destination for the kid, OSCORE_MAX_ID_LEN bytes.
+ * @param kid_len Destination for the length of the kid.
+ * @return int 0 if successful, -EBADMSG if the request is not protected or
+ * carries no kid, -EPERM if the kid is too long.
+ */
+int oscore_request_kid(const struct coap_packet *request, uint8_t *kid, uint8_t *kid_len);
+
+#ifdef CONFIG_APP_OSCORE_SEQ_STEP
+/**
+ * @brief Protect a request.
+ *
+ * The nonce must never repeat under the same key, also across reboots. So a
+ * bound on the sequence numbers is stored with the settings subsystem,
+ * CONFIG_APP_OSCORE_SEQ_STEP ahead of the sequence number in use, before any
+ * sequence number beyond the stored bound is used (RFC 8613, appendix
+ * B.1.1). After a reboot, the context continues from the stored bound.
+ * Without CONFIG_APP_OSCORE_SEQ_STEP, e.g. on the server, which only protects
+ * responses, requests cannot be protected and this is left out.
+ *
+ * @param ctx The security context to use.
+ * @param request The plain request.
+ * @param buf Buffer for the protected request.
+ * @param buf_len The length of the buffer.
+ * @param out The protected request.
+ * @param binding Filled with the parameters needed to verify the response.
+ * @return int 0 if successful, -EIO if the bound could not be stored,
+ * otherwise a negative error code.
+ */
+int oscore_protect_request(oscore_ctx_t *ctx, const struct coap_packet *request, uint8_t *buf,
+                           size_t buf_len, struct coap_packet *out, oscore_request_t *binding);
+#endif
+
+/**
+ * @brief Verify and decrypt a request.
+ *
+ * @param ctx The security context to use.
+ * @param request The protected request.
+ * @param buf Buffer for the plain request.
+ * @param buf_len The length of the buffer.
+ * @param out The plain request.
+ * @param binding Filled with the parameters needed to protect the response,
+ * if successful.
+ * @return int 0 if successful, -EPERM if the request uses an unknown context
+ * or is a replay, -EBADMSG if it fails verification, otherwise a negative
+ * error code.
+ */
+int oscore_unprotect_request(oscore_ctx_t *ctx, const struct coap_packet *request, uint8_t *buf,
+                             size_t buf_len, struct coap_packet *out, oscore_request_t *binding);
+
+/**
+ * @brief Protect a response.
+ *
+ * @param ctx The security context to use.
+ * @param binding The parameters of the request being answered.
+ * @param response The plain response.
+ * @param buf Buffer for the protected response.
+ * @param buf_len The length of the buffer.
+ * @param out The protected response.
+ * @return int 0 if successful, otherwise a negative error code.
+ */
+int oscore_protect_response(oscore_ctx_t *ctx, const oscore_request_t *binding,
+                            const struct coap_packet *response, uint8_t *buf, size_t buf_len,
+                            struct coap_packet *out);
+
+/**
+ * @brief Verify and decrypt a response.
+ *
+ * @param ctx The security context to use.
+ * @param binding The parameters of the request that was sent.
+ * @param response The protected response.
+ * @param buf Buffer for the plain response.
+ * @param buf_len The length of the buffer.
+ * @param out The plain response.
+ * @return int 0 if successful, -EACCES if the response is not protected,
+ * -EBADMSG if it fails verification, otherwise a negative error code.
+ */
+int oscore_unprotect_response(oscore_ctx_t *ctx, const oscore_request_t *binding,
+                              const struct coap_packet *response, uint8_t *buf, size_t buf_len,
+                              struct coap_packet *out);
+
+/**
+ * @brief Get a snapshot of the protection metrics of the specified context.
+ *
+ * @param ctx The security context to use.
+ * @param stats Destination for the metrics.
+ */
+void oscore_get_stats(const oscore_ctx_t *ctx, oscore_stats_t *stats);
+
+#endif // OSCORE_H
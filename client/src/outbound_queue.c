@@ -0,0 +1,504 @@
+/*
+ * Copyright (c) 2024 Albin Hjalmas (albin@bitman.se)
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/storage/flash_map.h>
+
+#include <errno.h>
+#include <string.h>
+
+#include "outbound_queue.h"
+
+LOG_MODULE_REGISTER(outbound_queue, LOG_LEVEL_INF);
+
+// Every message is stored as a little-endian 16-bit length followed by the
+// message itself, both in the ring and in the flash batches.
+#define RECORD_HDR_SIZE 2
+#define MSG_SIZE CONFIG_APP_OUTBOUND_QUEUE_MSG_SIZE
+
+#define FCB_MAGIC 0x4f425131 // "OBQ1"
+
+static bool ring_push(outbound_queue_t *queue, const uint8_t *message, size_t len)
+{
+    if (ring_buf_space_get(&queue->ring) < RECORD_HDR_SIZE + len) {
+        return false;
+    }
+
+    uint8_t hdr[RECORD_HDR_SIZE];
+    sys_put_le16(len, hdr);
+
+    ring_buf_put(&queue->ring, hdr, sizeof(hdr));
+    ring_buf_put(&queue->ring, message, len);
+    queue->ram_count++;
+
+    return true;
+}
+
+static int ring_peek(outbound_queue_t *queue, uint8_t *buf, size_t buf_len)
+{
+    uint8_t record[RECORD_HDR_SIZE + MSG_SIZE];
+
+    uint32_t n = ring_buf_peek(&queue->ring, record, sizeof(record));
+    if (n < RECORD_HDR_SIZE) {
+        return -ENOENT;
+    }
+
+    uint16_t len = sys_get_le16(record);
+    if (len > buf_len) {
+        return -ENOMEM;
+    }
+
+    memcpy(buf, &record[RECORD_HDR_SIZE], len);
+    return len;
+}
+
+static void ring_pop(outbound_queue_t *queue)
+{
+    uint8_t hdr[RECORD_HDR_SIZE];
+
+    ring_buf_peek(&queue->ring, hdr, sizeof(hdr));
+    ring_buf_get(&queue->ring, NULL, RECORD_HDR_SIZE + sys_get_le16(hdr));
+    queue->ram_count--;
+}
+
+#ifdef CONFIG_APP_OUTBOUND_QUEUE_FLASH
+
+/**
+ * @brief Locate the message at the specified offset of a batch.
+ *
+ * Batches are padded with zeroes to the flash write block size, so a zero
+ * length or a truncated header marks the end of the batch.
+ *
+ * @return int The length of the message, or -ENOENT at the end of the batch.
+ */
+static int batch_record(const uint8_t *batch, size_t batch_len, size_t off)
+{
+    if (off + RECORD_HDR_SIZE > batch_len) {
+        return -ENOENT;
+    }
+
+    uint16_t len = sys_get_le16(&batch[off]);
+    if (len == 0 || off + RECORD_HDR_SIZE + len > batch_len) {
+        return -ENOENT;
+    }
+
+    return len;
+}
+
+static int stage_write(outbound_queue_t *queue)
+{
+    if (queue->stage_count == 0) {
+        return 0;
+    }
+
+    size_t len = ROUND_UP(queue->stage_len, queue->fcb.f_align);
+    memset(&queue->stage[queue->stage_len], 0, len - queue->stage_len);
+
+    struct fcb_entry loc;
+    int rc = fcb_append(&queue->fcb, len, &loc);
+    if (rc < 0) {
+        return rc;
+    }
+
+    rc = flash_area_write(queue->fcb.fap, FCB_ENTRY_FA_DATA_OFF(loc), queue->stage, len);
+    if (rc < 0) {
+        LOG_ERR("Failed to write batch to flash: %d", rc);
+        return rc;
+    }
+
+    rc = fcb_append_finish(&queue->fcb, &loc);
+    if (rc < 0) {
+        LOG_ERR("Failed to finish batch: %d", rc);
+        return rc;
+    }
+
+    LOG_DBG("Wrote batch of %u messages (%zu bytes)", queue->stage_count, len);
+
+    queue->flash_count += queue->stage_count;
+    queue->stage_count = 0;
+    queue->stage_len = 0;
+
+    return 0;
+}
+
+static int stage_push(outbound_queue_t *queue, const uint8_t *message, size_t len)
+{
+    // Keep room for the zero padding that terminates a batch.
+    if (queue->stage_len + RECORD_HDR_SIZE + len + queue->fcb.f_align >
+        sizeof(queue->stage)) {
+        int rc = stage_write(queue);
+        if (rc < 0) {
+            return rc;
+        }
+    }
+
+    if (queue->stage_count == 0) {
+        k_work_reschedule(&queue->flush_work, K_MSEC(CONFIG_APP_OUTBOUND_QUEUE_FLASH_FLUSH_MS));
+    }
+
+    sys_put_le16(len, &queue->stage[queue->stage_len]);
+    memcpy(&queue->stage[queue->stage_len + RECORD_HDR_SIZE], message, len);
+    queue->stage_len += RECORD_HDR_SIZE + len;
+    queue->stage_count++;
+
+    return 0;
+}
+
+static void stage_pop(outbound_queue_t *queue)
+{
+    size_t record_len = RECORD_HDR_SIZE + sys_get_le16(queue->stage);
+
+    memmove(queue->stage, &queue->stage[record_len], queue->stage_len - record_len);
+    queue->stage_len -= record_len;
+    queue->stage_count--;
+}
+
+/**
+ * @brief Make sure the oldest unread batch in flash is loaded.
+ *
+ * @return int 0 if a batch is loaded, -ENOENT if flash holds no unread batch.
+ */
+static int flash_load(outbound_queue_t *queue)
+{
+    if (queue->read_loaded) {
+        return 0;
+    }
+
+    while (fcb_getnext(&queue->fcb, &queue->read_loc) == 0) {
+        if (queue->read_loc.fe_data_len > sizeof(queue->read_batch)) {
+            LOG_WRN("Skipping oversized batch (%u bytes)", queue->read_loc.fe_data_len);
+            continue;
+        }
+
+        int rc = flash_area_read(queue->fcb.fap, FCB_ENTRY_FA_DATA_OFF(queue->read_loc),
+                                 queue->read_batch, queue->read_loc.fe_data_len);
+        if (rc < 0) {
+            LOG_ERR("Failed to read batch from flash: %d", rc);
+            return rc;
+        }
+
+        if (batch_record(queue->read_batch, queue->read_loc.fe_data_len, 0) < 0) {
+            continue;
+        }
+
+        queue->read_loaded = true;
+        queue->read_off = 0;
+        return 0;
+    }
+
+    return -ENOENT;
+}
+
+/**
+ * @brief Release the flash used by batches that have been read completely.
+ *
+ * Sectors are only erased once every batch in them has been read, so a batch
+ * that was partially consumed before a reboot is replayed from its start.
+ */
+static void flash_release(outbound_queue_t *queue)
+{
+    struct fcb_entry next = queue->read_loc;
+
+    if (fcb_getnext(&queue->fcb, &next) != 0) {
+        // Everything in flash has been read.
+        fcb_clear(&queue->fcb);
+        memset(&queue->read_loc, 0, sizeof(queue->read_loc));
+        queue->flash_count = 0;
+        return;
+    }
+
+    if (next.fe_sector != queue->fcb.f_oldest) {
+        fcb_rotate(&queue->fcb);
+        memset(&queue->read_loc, 0, sizeof(queue->read_loc));
+    }
+}
+
+static int flash_peek(outbound_queue_t *queue, uint8_t *buf, size_t buf_len)
+{
+    int rc = flash_load(queue);
+    if (rc == -ENOENT) {
+        // Whatever was counted is unreadable. Resynchronize with the flash contents.
+        queue->flash_count = 0;
+    }
+
+    if (rc < 0) {
+        return rc;
+    }
+
+    int len = batch_record(queue->read_batch, queue->read_loc.fe_data_len, queue->read_off);
+    if (len < 0) {
+        return len;
+    }
+
+    if (len > buf_len) {
+        return -ENOMEM;
+    }
+
+    memcpy(buf, &queue->read_batch[queue->read_off + RECORD_HDR_SIZE], len);
+    return len;
+}
+
+static void flash_pop(outbound_queue_t *queue)
+{
+    int len = batch_record(queue->read_batch, queue->read_loc.fe_data_len, queue->read_off);
+
+    queue->read_off += RECORD_HDR_SIZE + len;
+    queue->flash_count--;
+
+    if (batch_record(queue->read_batch, queue->read_loc.fe_data_len, queue->read_off) < 0) {
+        queue->read_loaded = false;
+        flash_release(queue);
+    }
+}
+
+static void flush_work_handler(struct k_work *work)
+{
+    struct k_work_delayable *dwork = k_work_delayable_from_work(work);
+    outbound_queue_t *queue = CONTAINER_OF(dwork, outbound_queue_t, flush_work);
+
+    k_mutex_lock(&queue->lock, K_FOREVER);
+    int rc = stage_write(queue);
+    k_mutex_unlock(&queue->lock);
+
+    if (rc < 0) {
+        LOG_ERR("Failed to flush batch: %d", rc);
+    }
+}
+
+static int flash_count_unread(outbound_queue_t *queue)
+{
+    struct fcb_entry loc = { 0 };
+
+    queue->flash_count = 0;
+
+    while (fcb_getnext(&queue->fcb, &loc) == 0) {
+        if (loc.fe_data_len > sizeof(queue->read_batch)) {
+            continue;
+        }
+
+        int rc = flash_area_read(queue->fcb.fap, FCB_ENTRY_FA_DATA_OFF(loc), queue->read_batch,
+                                 loc.fe_data_len);
+        if (rc < 0) {
+            return rc;
+        }
+
+        size_t off = 0;
+        int len;
+        while ((len = batch_record(queue->read_batch, loc.fe_data_len, off)) > 0) {
+            off += RECORD_HDR_SIZE + len;
+            queue->flash_count++;
+        }
+    }
+
+    return 0;
+}
+
+static int flash_init(outbound_queue_t *queue, int flash_area_id)
+{
+    uint32_t sector_cnt = ARRAY_SIZE(queue->sectors);
+
+    int rc = flash_area_get_sectors(flash_area_id, &sector_cnt, queue->sectors);
+    if (rc < 0) {
+        LOG_ERR("Failed to get flash sectors: %d", rc);
+        return rc;
+    }
+
+    queue->fcb.f_magic = FCB_MAGIC;
+    queue->fcb.f_version = 1;
+    queue->fcb.f_sectors = queue->sectors;
+    queue->fcb.f_sector_cnt = sector_cnt;
+    queue->fcb.f_scratch_cnt = 0;
+
+    rc = fcb_init(flash_area_id, &queue->fcb);
+    if (rc < 0) {
+        // Not an outbound queue, or a different layout. Start over.
+        LOG_WRN("Erasing flash area %d (fcb_init %d)", flash_area_id, rc);
+
+        const struct flash_area *fa;
+        rc = flash_area_open(flash_area_id, &fa);
+        if (rc < 0) {
+            return rc;
+        }
+
+        rc = flash_area_erase(fa, 0, fa->fa_size);
+        flash_area_close(fa);
+        if (rc < 0) {
+            return rc;
+        }
+
+        rc = fcb_init(flash_area_id, &queue->fcb);
+        if (rc < 0) {
+            LOG_ERR("Failed to initialize flash circular buffer: %d", rc);
+            return rc;
+        }
+    }
+
+    rc = flash_count_unread(queue);
+    if (rc < 0) {
+        return rc;
+    }
+
+    k_work_init_delayable(&queue->flush_work, flush_work_handler);
+    queue->flash_ready = true;
+
+    if (queue->flash_count > 0) {
+        LOG_INF("Replaying %u messages from flash", queue->flash_count);
+    }
+
+    return 0;
+}
+
+#endif // CONFIG_APP_OUTBOUND_QUEUE_FLASH
+
+int outbound_queue_init(outbound_queue_t *queue, int flash_area_id)
+{
+    if (queue == NULL) {
+        return -EINVAL;
+    }
+
+    memset(queue, 0, sizeof(*queue));
+    k_mutex_init(&queue->lock);
+    ring_buf_init(&queue->ring, sizeof(queue->ring_storage), queue->ring_storage);
+
+#ifdef CONFIG_APP_OUTBOUND_QUEUE_FLASH
+    if (flash_area_id >= 0) {
+        return flash_init(queue, flash_area_id);
+    }
+#else
+    ARG_UNUSED(flash_area_id);
+#endif
+
+    return 0;
+}
+
+int outbound_queue_push(outbound_queue_t *queue, const uint8_t *message, size_t len)
+{
+    if (queue == NULL || message == NULL || len == 0 || len > MSG_SIZE) {
+        return -EINVAL;
+    }
+
+    int rc = 0;
+
+    k_mutex_lock(&queue->lock, K_FOREVER);
+
+#ifdef CONFIG_APP_OUTBOUND_QUEUE_FLASH
+    // Once anything has spilled to flash, keep appending there until it has
+    // been drained, so that newer messages never overtake older ones.
+    bool spilled = queue->flash_count > 0 || queue->stage_count > 0;
+
+    if (spilled || !ring_push(queue, message, len)) {
+        rc = queue->flash_ready ? stage_push(queue, message, len) : -ENOSPC;
+    }
+#else
+    if (!ring_push(queue, message, len)) {
+        rc = -ENOSPC;
+    }
+#endif
+
+    k_mutex_unlock(&queue->lock);
+
+    return rc;
+}
+
+int outbound_queue_peek(outbound_queue_t *queue, uint8_t *buf, size_t buf_len)
+{
+    if (queue == NULL || buf == NULL) {
+        return -EINVAL;
+    }
+
+    int rc;
+
+    k_mutex_lock(&queue->lock, K_FOREVER);
+
+    rc = ring_peek(queue, buf, buf_len);
+
+#ifdef CONFIG_APP_OUTBOUND_QUEUE_FLASH
+    if (rc == -ENOENT && queue->flash_count > 0) {
+        rc = flash_peek(queue, buf, buf_len);
+    }
+
+    if (rc == -ENOENT && queue->stage_count > 0) {
+        uint16_t len = sys_get_le16(queue->stage);
+        if (len > buf_len) {
+            rc = -ENOMEM;
+        } else {
+            memcpy(buf, &queue->stage[RECORD_HDR_SIZE], len);
+            rc = len;
+        }
+    }
+#endif
+
+    k_mutex_unlock(&queue->lock);
+
+    return rc;
+}
+
+int outbound_queue_pop(outbound_queue_t *queue)
+{
+    if (queue == NULL) {
+        return -EINVAL;
+    }
+
+    int rc = 0;
+
+    k_mutex_lock(&queue->lock, K_FOREVER);
+
+    if (queue->ram_count > 0) {
+        ring_pop(queue);
+#ifdef CONFIG_APP_OUTBOUND_QUEUE_FLASH
+    } else if (queue->flash_count > 0) {
+        // The head is in flash. Popping the stage instead would lose a newer
+        // message than the one peeked.
+        rc = flash_load(queue);
+        if (rc == 0) {
+            flash_pop(queue);
+        }
+    } else if (queue->stage_count > 0) {
+        stage_pop(queue);
+#endif
+    } else {
+        rc = -ENOENT;
+    }
+
+    k_mutex_unlock(&queue->lock);
+
+    return rc;
+}
+
+int outbound_queue_sync(outbound_queue_t *queue)
+{
+    if (queue == NULL) {
+        return -EINVAL;
+    }
+
+    int rc = 0;
+
+#ifdef CONFIG_APP_OUTBOUND_QUEUE_FLASH
+    k_mutex_lock(&queue->lock, K_FOREVER);
+    if (queue->flash_ready) {
+        rc = stage_write(queue);
+    }
+    k_mutex_unlock(&queue->lock);
+#endif
+
+    return rc;
+}
+
+size_t outbound_queue_count(outbound_queue_t *queue)
+{
+    size_t count;
+
+    k_mutex_lock(&queue->lock, K_FOREVER);
+    count = queue->ram_count;
+#ifdef CONFIG_APP_OUTBOUND_QUEUE_FLASH
+    count += queue->flash_count + queue->stage_count;
+#endif
+    k_mutex_unlock(&queue->lock);
+
+    return count;
+}
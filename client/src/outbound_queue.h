@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2024 Albin Hjalmas (albin@bitman.se)
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef OUTBOUND_QUEUE_H
+#define OUTBOUND_QUEUE_H
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/ring_buffer.h>
+
+#ifdef CONFIG_APP_OUTBOUND_QUEUE_FLASH
+#include <zephyr/fs/fcb.h>
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/**
+ * @brief Bounded FIFO of outbound messages.
+ *
+ * Messages are kept in a RAM ring buffer. When the ring is full, new messages
+ * are spilled to a flash circular buffer. Spilled messages are collected into
+ * batches before being written, to limit flash wear, and survive a reboot.
+ * Once anything has been spilled, new messages follow it into flash so that
+ * the FIFO order is preserved.
+ */
+typedef struct {
+    struct k_mutex lock;
+    struct ring_buf ring; // RAM stage of the queue, oldest messages
+    uint8_t ring_storage[CONFIG_APP_OUTBOUND_QUEUE_RAM_SIZE];
+    uint32_t ram_count; // Number of messages in the ring
+#ifdef CONFIG_APP_OUTBOUND_QUEUE_FLASH
+    bool flash_ready; // Flash circular buffer is initialized and usable
+    struct fcb fcb;
+    struct flash_sector sectors[CONFIG_APP_OUTBOUND_QUEUE_FLASH_SECTORS];
+    uint32_t flash_count; // Number of unread messages in flash
+    struct fcb_entry read_loc; // Location of the batch currently being read
+    bool read_loaded; // read_batch holds the batch at read_loc
+    size_t read_off; // Offset of the next message in read_batch
+    uint8_t read_batch[CONFIG_APP_OUTBOUND_QUEUE_FLASH_BATCH_SIZE];
+    uint8_t stage[CONFIG_APP_OUTBOUND_QUEUE_FLASH_BATCH_SIZE]; // Batch waiting to be written
+    size_t stage_len;
+    uint32_t stage_count; // Number of messages in the stage
+    struct k_work_delayable flush_work; // Writes a partially filled stage
+#endif
+} outbound_queue_t;
+
+/**
+ * @brief Initialize the specified outbound queue.
+ *
+ * Messages left in flash by a previous boot are replayed, in order, ahead
+ * of any new messages.
+ *
+ * @param queue The outbound queue to initialize.
+ * @param flash_area_id The flash area to spill to, or a negative value to keep
+ * the queue in RAM only.
+ * @return int 0 if successful, otherwise a negative error code.
+ */
+int outbound_queue_init(outbound_queue_t *queue, int flash_area_id);
+
+/**
+ * @brief Append a message to the specified outbound queue.
+ *
+ * @param queue The outbound queue to use.
+ * @param message The message to append.
+ * @param len The length of the message.
+ * @return int 0 if successful, -ENOSPC if the queue is full, otherwise a
+ * negative error code.
+ */
+int outbound_queue_push(outbound_queue_t *queue, const uint8_t *message, size_t len);
+
+/**
+ * @brief Copy the oldest message of the specified outbound queue.
+ *
+ * The message stays in the queue until outbound_queue_pop() is called.
+ *
+ * @param queue The outbound queue to use.
+ * @param buf Buffer to copy the message into.
+ * @param buf_len The length of the buffer.
+ * @return int The length of the message if successful, -ENOENT if the queue
+ * is empty, otherwise a negative error code.
+ */
+int outbound_queue_peek(outbound_queue_t *queue, uint8_t *buf, size_t buf_len);
+
+/**
+ * @brief Remove the oldest message of the specified outbound queue.
+ *
+ * @param queue The outbound queue to use.
+ * @return int 0 if successful, -ENOENT if the queue is empty, otherwise a
+ * negative error code.
+ */
+int outbound_queue_pop(outbound_queue_t *queue);
+
+/**
+ * @brief Write any batched messages to flash immediately.
+ *
+ * @param queue The outbound queue to use.
+ * @return int 0 if successful, otherwise a negative error code.
+ */
+int outbound_queue_sync(outbound_queue_t *queue);
+
+/**
+ * @brief Get the number of messages in the specified outbound queue.
+ *
+ * @param queue The outbound queue to use.
+ * @return size_t The number of queued messages.
+ */
+size_t outbound_queue_count(outbound_queue_t *queue);
+
+#endif // OUTBOUND_QUEUE_H
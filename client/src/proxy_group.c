@@ -0,0 +1,288 @@
+/*
+ * Copyright (c) 2024 Albin Hjalmas (albin@bitman.se)
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/net/net_ip.h>
+#include <zephyr/sys/util.h>
+
+#include <errno.h>
+#include <string.h>
+
+#include "proxy_group.h"
+
+LOG_MODULE_REGISTER(proxy_group, LOG_LEVEL_INF);
+
+BUILD_ASSERT(PROXY_GROUP_MAX_MEMBERS <= 32, "Members are tracked in a 32-bit mask");
+
+#define FAILURE_THRESHOLD CONFIG_APP_PROXY_GROUP_FAILURE_THRESHOLD
+#define EJECT_MIN_MS CONFIG_APP_PROXY_GROUP_EJECT_MIN_MS
+#define EJECT_MAX_MS CONFIG_APP_PROXY_GROUP_EJECT_MAX_MS
+
+static bool same_peer(const server_proxy_t *a, const server_proxy_t *b)
+{
+    return a->client.peer.sin6_port == b->client.peer.sin6_port &&
+           net_ipv6_addr_cmp(&a->client.peer.sin6_addr, &b->client.peer.sin6_addr);
+}
+
+static bool is_candidate(const proxy_group_member_t *member, size_t index, uint32_t exclude)
+{
+    return member->proxy != NULL && !(exclude & BIT(index));
+}
+
+static int select_probe(proxy_group_t *group, uint32_t exclude, int64_t now)
+{
+    for (size_t i = 0; i < PROXY_GROUP_MAX_MEMBERS; i++) {
+        proxy_group_member_t *member = &group->members[i];
+
+        if (is_candidate(member, i, exclude) && member->state == PROXY_GROUP_MEMBER_EJECTED &&
+            now >= member->ejected_until) {
+            member->state = PROXY_GROUP_MEMBER_PROBING;
+            LOG_INF("Probing member %zu", i);
+            return i;
+        }
+    }
+
+    return -ENOENT;
+}
+
+static int select_healthy(proxy_group_t *group, uint32_t exclude)
+{
+    int selected = -ENOENT;
+
+    // Start at the cursor so that ties are broken round-robin.
+    for (size_t n = 0; n < PROXY_GROUP_MAX_MEMBERS; n++) {
+        size_t i = (group->next + n) % PROXY_GROUP_MAX_MEMBERS;
+        proxy_group_member_t *member = &group->members[i];
+
+        if (!is_candidate(member, i, exclude) || member->state != PROXY_GROUP_MEMBER_HEALTHY) {
+            continue;
+        }
+
+        if (selected < 0) {
+            selected = i;
+            if (group->policy == PROXY_GROUP_ROUND_ROBIN) {
+                break;
+            }
+            continue;
+        }
+
+        const proxy_group_member_t *best = &group->members[selected];
+
+        if ((group->policy == PROXY_GROUP_LEAST_OUTSTANDING &&
+             member->outstanding < best->outstanding) ||
+            (group->policy == PROXY_GROUP_LOWEST_SRTT && member->srtt_ms < best->srtt_ms)) {
+            selected = i;
+        }
+    }
+
+    return selected;
+}
+
+static int select_any(proxy_group_t *group, uint32_t exclude)
+{
+    int selected = -ENOENT;
+
+    for (size_t i = 0; i < PROXY_GROUP_MAX_MEMBERS; i++) {
+        proxy_group_member_t *member = &group->members[i];
+
+        if (is_candidate(member, i, exclude) &&
+            (selected < 0 || member->ejected_until < group->members[selected].ejected_until)) {
+            selected = i;
+        }
+    }
+
+    return selected;
+}
+
+static void eject(proxy_group_member_t *member, size_t index)
+{
+    member->eject_ms = member->eject_ms == 0 ? EJECT_MIN_MS :
+                                               MIN(member->eject_ms * 2, EJECT_MAX_MS);
+    member->ejected_until = k_uptime_get() + member->eject_ms;
+    member->state = PROXY_GROUP_MEMBER_EJECTED;
+
+    LOG_WRN("Member %zu ejected for %u ms after %u failures", index, member->eject_ms,
+            member->failures);
+}
+
+int proxy_group_init(proxy_group_t *group, proxy_group_policy_t policy)
+{
+    if (group == NULL) {
+        return -EINVAL;
+    }
+
+    memset(group, 0, sizeof(*group));
+    k_mutex_init(&group->lock);
+    group->policy = policy;
+
+    return 0;
+}
+
+int proxy_group_set_policy(proxy_group_t *group, proxy_group_policy_t policy)
+{
+    if (group == NULL || policy > PROXY_GROUP_LOWEST_SRTT) {
+        return -EINVAL;
+    }
+
+    k_mutex_lock(&group->lock, K_FOREVER);
+    group->policy = policy;
+    k_mutex_unlock(&group->lock);
+
+    return 0;
+}
+
+int proxy_group_add(proxy_group_t *group, server_proxy_t *proxy)
+{
+    if (group == NULL || proxy == NULL) {
+        return -EINVAL;
+    }
+
+    int rc = -ENOMEM;
+    proxy_group_member_t *free_slot = NULL;
+
+    k_mutex_lock(&group->lock, K_FOREVER);
+
+    for (size_t i = 0; i < PROXY_GROUP_MAX_MEMBERS; i++) {
+        proxy_group_member_t *member = &group->members[i];
+
+        if (member->proxy == NULL) {
+            free_slot = free_slot != NULL ? free_slot : member;
+        } else if (member->proxy == proxy || same_peer(member->proxy, proxy)) {
+            rc = -EALREADY;
+            goto exit;
+        }
+    }
+
+    if (free_slot != NULL) {
+        memset(free_slot, 0, sizeof(*free_slot));
+        free_slot->proxy = proxy;
+        rc = 0;
+    }
+
+exit:
+    k_mutex_unlock(&group->lock);
+    return rc;
+}
+
+int proxy_group_remove(proxy_group_t *group, server_proxy_t *proxy)
+{
+    if (group == NULL || proxy == NULL) {
+        return -EINVAL;
+    }
+
+    int rc = -ENOENT;
+
+    k_mutex_lock(&group->lock, K_FOREVER);
+
+    for (size_t i = 0; i < PROXY_GROUP_MAX_MEMBERS; i++) {
+        if (group->members[i].proxy == proxy) {
+            group->members[i].proxy = NULL;
+            rc = 0;
+            break;
+        }
+    }
+
+    k_mutex_unlock(&group->lock);
+    return rc;
+}
+
+int proxy_group_select(proxy_group_t *group, uint32_t exclude, server_proxy_t **proxy)
+{
+    int64_t now = k_uptime_get();
+
+    k_mutex_lock(&group->lock, K_FOREVER);
+
+    int selected = select_probe(group, exclude, now);
+    if (selected < 0) {
+        selected = select_healthy(group, exclude);
+    }
+    if (selected < 0) {
+        selected = select_any(group, exclude);
+    }
+
+    if (selected >= 0) {
+        proxy_group_member_t *member = &group->members[selected];
+        member->outstanding++;
+        member->sent++;
+        *proxy = member->proxy;
+        group->next = selected + 1;
+    }
+
+    k_mutex_unlock(&group->lock);
+
+    return selected;
+}
+
+void proxy_group_complete(proxy_group_t *group, int index, const server_proxy_t *proxy, int rc,
+                          uint32_t rtt_ms)
+{
+    if (index < 0 || index >= PROXY_GROUP_MAX_MEMBERS) {
+        return;
+    }
+
+    k_mutex_lock(&group->lock, K_FOREVER);
+
+    proxy_group_member_t *member = &group->members[index];
+
+    // The member has been removed, or its slot reused, in the meantime.
+    if (member->proxy != proxy) {
+        goto exit;
+    }
+
+    if (member->outstanding > 0) {
+        member->outstanding--;
+    }
+
+    if (rc == SERVER_PROXY_DEFERRED || rc == SERVER_PROXY_BUSY) {
+        // Parked in the backlog of the member without reaching the peer, or
+        // refused by a peer applying backpressure, so nothing was learned
+        // about its health. Let the next request probe again.
+        if (member->state == PROXY_GROUP_MEMBER_PROBING) {
+            member->state = PROXY_GROUP_MEMBER_EJECTED;
+        }
+        goto exit;
+    }
+
+    if (server_proxy_is_retryable(rc)) {
+        member->failed++;
+        member->failures = MIN(member->failures + 1, UINT8_MAX);
+
+        if (member->state == PROXY_GROUP_MEMBER_PROBING ||
+            (member->state == PROXY_GROUP_MEMBER_HEALTHY &&
+             member->failures >= FAILURE_THRESHOLD)) {
+            eject(member, index);
+        }
+        goto exit;
+    }
+
+    // The peer answered, even if it rejected the request.
+    if (rc == 0) {
+        // Smoothed as in RFC 6298, with a gain of 1/8.
+        member->srtt_ms = member->srtt_ms == 0 ? MAX(rtt_ms, 1) :
+                                                 (7 * member->srtt_ms + rtt_ms) / 8;
+    } else {
+        member->failed++;
+    }
+
+    member->failures = 0;
+
+    if (member->state != PROXY_GROUP_MEMBER_HEALTHY) {
+        LOG_INF("Member %d recovered", index);
+        member->state = PROXY_GROUP_MEMBER_HEALTHY;
+        member->eject_ms = 0;
+    }
+
+exit:
+    k_mutex_unlock(&group->lock);
+}
+
+void proxy_group_get_members(proxy_group_t *group, proxy_group_member_t *members)
+{
+    k_mutex_lock(&group->lock, K_FOREVER);
+    memcpy(members, group->members, sizeof(group->members));
+    k_mutex_unlock(&group->lock);
+}
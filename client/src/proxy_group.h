@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2024 Albin Hjalmas (albin@bitman.se)
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef PROXY_GROUP_H
+#define PROXY_GROUP_H
+
+#include <zephyr/kernel.h>
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "server_proxy.h"
+
+#define PROXY_GROUP_MAX_MEMBERS CONFIG_APP_PROXY_GROUP_MAX_MEMBERS
+
+typedef enum {
+    PROXY_GROUP_ROUND_ROBIN,
+    PROXY_GROUP_LEAST_OUTSTANDING,
+    PROXY_GROUP_LOWEST_SRTT,
+} proxy_group_policy_t;
+
+typedef enum {
+    PROXY_GROUP_MEMBER_HEALTHY, // Selected by the policy
+    PROXY_GROUP_MEMBER_EJECTED, // Failed repeatedly, not selected until the ejection ends
+    PROXY_GROUP_MEMBER_PROBING, // A single request is testing whether it recovered
+} proxy_group_member_state_t;
+
+typedef struct {
+    server_proxy_t *proxy; // NULL if the slot is unused
+    proxy_group_member_state_t state;
+    uint8_t failures; // Consecutive failures
+    uint16_t outstanding; // Requests sent and not yet completed
+    uint32_t srtt_ms; // Smoothed round-trip time, 0 until measured
+    uint32_t eject_ms; // Duration of the current or last ejection
+    int64_t ejected_until; // Uptime (ms) when the member may be probed
+    uint32_t sent; // Number of requests sent
+    uint32_t failed; // Number of requests that failed
+} proxy_group_member_t;
+
+/**
+ * @brief A set of interchangeable server proxies.
+ *
+ * Requests are spread over the members according to a selection policy.
+ * Members that fail repeatedly are ejected for an exponentially growing
+ * period, after which a single request probes whether they recovered.
+ */
+typedef struct {
+    struct k_mutex lock;
+    proxy_group_policy_t policy;
+    proxy_group_member_t members[PROXY_GROUP_MAX_MEMBERS];
+    size_t next; // Round-robin cursor
+} proxy_group_t;
+
+/**
+ * @brief Initialize an empty proxy group.
+ *
+ * @param group The proxy group to initialize.
+ * @param policy The selection policy to use.
+ * @return int 0 if successful, otherwise a negative error code.
+ */
+int proxy_group_init(proxy_group_t *group, proxy_group_policy_t policy);
+
+/**
+ * @brief Change the selection policy of the specified proxy group.
+ *
+ * @param group The proxy group to use.
+ * @param policy The selection policy to use.
+ * @return int 0 if successful, otherwise a negative error code.
+ */
+int proxy_group_set_policy(proxy_group_t *group, proxy_group_policy_t policy);
+
+/**
+ * @brief Add a started server proxy to the specified proxy group.
+ *
+ * @param group The proxy group to use.
+ * @param proxy The server proxy to add.
+ * @return int 0 if successful, -EALREADY if a member already connects to the
+ * same peer, -ENOMEM if the group is full, otherwise a negative error code.
+ */
+int proxy_group_add(proxy_group_t *group, server_proxy_t *proxy);
+
+/**
+ * @brief Remove a server proxy from the specified proxy group.
+ *
+ * Requests already handed to the proxy may still complete. The proxy must
+ * stay valid until they have.
+ *
+ * @param group The proxy group to use.
+ * @param proxy The server proxy to remove.
+ * @return int 0 if successful, otherwise a negative error code.
+ */
+int proxy_group_remove(proxy_group_t *group, server_proxy_t *proxy);
+
+/**
+ * @brief Select a member to send a request to.
+ *
+ * Ejected members that are due for a probe are preferred, so that they get a
+ * chance to recover. If every member is ejected, the one whose ejection ends
+ * first is selected rather than failing the request. The selected member is
+ * counted as having an outstanding request until proxy_group_complete() is
+ * called.
+ *
+ * @param group The proxy group to use.
+ * @param exclude Bitmask of member indices not to select, e.g. those already tried.
+ * @param proxy Set to the server proxy of the selected member.
+ * @return int The index of the selected member, or -ENOENT if none is available.
+ */
+int proxy_group_select(proxy_group_t *group, uint32_t exclude, server_proxy_t **proxy);
+
+/**
+ * @brief Report the outcome of a request sent to a member.
+ *
+ * @param group The proxy group to use.
+ * @param index The index of the member, as returned by proxy_group_select().
+ * @param proxy The server proxy the request was sent through.
+ * @param rc The result of the request. SERVER_PROXY_DEFERRED and
+ * SERVER_PROXY_BUSY do not affect the health of the member.
+ * @param rtt_ms The round-trip time of a successful request.
+ */
+void proxy_group_complete(proxy_group_t *group, int index, const server_proxy_t *proxy, int rc,
+                          uint32_t rtt_ms);
+
+/**
+ * @brief Copy the member table of the specified proxy group.
+ *
+ * @param group The proxy group to use.
+ * @param members Destination for PROXY_GROUP_MAX_MEMBERS members.
+ */
+void proxy_group_get_members(proxy_group_t *group, proxy_group_member_t *members);
+
+#endif // PROXY_GROUP_H
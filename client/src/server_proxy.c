@@ -1,36 +1,361 @@
 #include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/slist.h>
 
 #include "server_proxy.h"
 
+LOG_MODULE_REGISTER(server_proxy, LOG_LEVEL_INF);
+
 static uint8_t sketch[CONFIG_COAP_CLIENT_MESSAGE_HEADER_SIZE + CONFIG_COAP_CLIENT_MESSAGE_SIZE];
 
+// Proxies that have a backlog attached. Only used from the transmitting thread.
+static sys_slist_t backlogged = SYS_SLIST_STATIC_INIT(&backlogged);
+
+#ifdef CONFIG_APP_COAPS
+K_THREAD_STACK_DEFINE(reconnect_stack, CONFIG_APP_COAPS_RECONNECT_STACK_SIZE);
+static struct k_work_q reconnect_queue;
+
+static void reconnect_handler(struct k_work *work)
+{
+    struct k_work_delayable *dwork = k_work_delayable_from_work(work);
+    server_proxy_t *proxy = CONTAINER_OF(dwork, server_proxy_t, reconnect);
+
+    int rc = coap_client_reconnect(&proxy->client);
+    if (rc < 0) {
+        proxy->reconnect_backoff_ms =
+                proxy->reconnect_backoff_ms == 0 ?
+                        CONFIG_APP_OUTBOUND_QUEUE_RETRY_MIN_MS :
+                        MIN(proxy->reconnect_backoff_ms * 2, CONFIG_APP_OUTBOUND_QUEUE_RETRY_MAX_MS);
+        LOG_WRN("Failed to reconnect DTLS session, retrying in %u ms: %d",
+                proxy->reconnect_backoff_ms, rc);
+        k_work_reschedule_for_queue(&reconnect_queue, dwork, K_MSEC(proxy->reconnect_backoff_ms));
+        return;
+    }
+
+    proxy->reconnect_backoff_ms = 0;
+
+    // Hands the client back to the transmitting thread.
+    atomic_clear(&proxy->disconnected);
+}
+
+/**
+ * @brief Reestablish the DTLS session of a proxy in the background.
+ *
+ * The transmitting thread leaves the client alone until the session is up
+ * again. Messages sent meanwhile fail with -ENOTCONN and are deferred.
+ */
+static void start_reconnect(server_proxy_t *proxy, k_timeout_t delay)
+{
+    if (!atomic_cas(&proxy->disconnected, 0, 1)) {
+        return; // Already reconnecting
+    }
+
+    k_work_schedule_for_queue(&reconnect_queue, &proxy->reconnect, delay);
+}
+
+static void init_reconnect(server_proxy_t *proxy)
+{
+    static bool started;
+
+    if (!started) {
+        k_work_queue_start(&reconnect_queue, reconnect_stack,
+                           K_THREAD_STACK_SIZEOF(reconnect_stack),
+                           CONFIG_APP_COAPS_RECONNECT_THREAD_PRIORITY, NULL);
+        k_thread_name_set(&reconnect_queue.thread, "dtls_reconnect");
+        started = true;
+    }
+
+    atomic_clear(&proxy->disconnected);
+    proxy->reconnect_backoff_ms = 0;
+    k_work_init_delayable(&proxy->reconnect, reconnect_handler);
+}
+#endif // CONFIG_APP_COAPS
+
+static int send_print(server_proxy_t *proxy, const char *const message)
+{
+    static const char *const PATH[] = { "print", NULL };
+    return coap_client_put(&proxy->client, PATH, (const uint8_t *)message, strlen(message) + 1);
+}
+
+static int wait_print(server_proxy_t *proxy, int request, k_timeout_t timeout)
+{
+    struct coap_packet reply;
+    int rc = coap_client_wait_and_receive(&proxy->client, request, &reply, sketch, sizeof(sketch),
+                                          timeout);
+    if (rc < 0) {
+        return rc;
+    }
+
+    uint8_t code = coap_header_get_code(&reply);
+    if (code == COAP_RESPONSE_CODE_SERVICE_UNAVAILABLE) {
+        // The server is applying backpressure, keep the message and retry later.
+        return SERVER_PROXY_BUSY;
+    }
+
+    if (code != COAP_RESPONSE_CODE_CHANGED) {
+        return -EIO;
+    }
+
+    return 0;
+}
+
+static void backoff(server_proxy_t *proxy)
+{
+    proxy->backoff_ms = proxy->backoff_ms == 0 ?
+                                CONFIG_APP_OUTBOUND_QUEUE_RETRY_MIN_MS :
+                                MIN(proxy->backoff_ms * 2, CONFIG_APP_OUTBOUND_QUEUE_RETRY_MAX_MS);
+    proxy->retry_at = k_uptime_get() + proxy->backoff_ms;
+}
+
+int server_proxy_defer(server_proxy_t *proxy, const char *const message)
+{
+    if (proxy->backlog == NULL) {
+        return -ENOTSUP;
+    }
+
+    int rc = outbound_queue_push(proxy->backlog, (const uint8_t *)message, strlen(message) + 1);
+    if (rc < 0) {
+        LOG_ERR("Backlog full, dropping message: %d", rc);
+        return rc;
+    }
+
+    if (proxy->backoff_ms == 0) {
+        backoff(proxy);
+    }
+
+    return SERVER_PROXY_DEFERRED;
+}
+
+bool server_proxy_has_backlog(server_proxy_t *proxy)
+{
+    return proxy->backlog != NULL && outbound_queue_count(proxy->backlog) > 0;
+}
+
+bool server_proxy_is_retryable(int rc)
+{
+    // -EACCES means the peer rejected our OSCORE context, retrying will not help.
+    return rc < 0 && rc != -EIO && rc != -EINVAL && rc != -EMSGSIZE && rc != -EACCES;
+}
+
+static int drain(server_proxy_t *proxy, k_timeout_t timeout)
+{
+    char message[CONFIG_APP_OUTBOUND_QUEUE_MSG_SIZE];
+    int drained = 0;
+
+    while (drained < CONFIG_APP_OUTBOUND_QUEUE_DRAIN_BUDGET) {
+        int len = outbound_queue_peek(proxy->backlog, (uint8_t *)message, sizeof(message));
+        if (len == -ENOENT) {
+            break;
+        }
+
+        if (len <= 0) {
+            backoff(proxy);
+            return len < 0 ? len : -EIO;
+        }
+
+        message[len - 1] = '\0';
+
+        int rc = send_print(proxy, message);
+        if (rc >= 0) {
+            rc = wait_print(proxy, rc, timeout);
+        }
+
+        if (server_proxy_is_retryable(rc)) {
+            // Still unreachable. Back off and leave the message at the head of the queue.
+            backoff(proxy);
+
+#ifdef CONFIG_APP_COAPS
+            // The peer may have rebooted and lost the DTLS session. Reconnect so
+            // that the next attempt starts with a fresh handshake. A busy peer
+            // answered, so its session is fine.
+            if (rc != SERVER_PROXY_BUSY && proxy->client.sec_tag >= 0) {
+                start_reconnect(proxy, K_NO_WAIT);
+            }
+#endif
+
+            return rc;
+        }
+
+        if (rc < 0) {
+            LOG_ERR("Backlogged message rejected: %d", rc);
+        }
+
+        int popped = outbound_queue_pop(proxy->backlog);
+        if (popped < 0) {
+            // The message would be sent again. Stop until the queue is readable.
+            LOG_ERR("Failed to remove backlogged message: %d", popped);
+            backoff(proxy);
+            return popped;
+        }
+
+        drained++;
+    }
+
+    proxy->backoff_ms = 0;
+    proxy->retry_at = 0;
+
+    return drained;
+}
+
 int server_proxy_start(server_proxy_t *proxy, const char *const peer_addr, uint16_t port)
 {
     return coap_client_start(&proxy->client, peer_addr, port);
 }
 
+int server_proxy_start_secure(server_proxy_t *proxy, const char *const peer_addr, uint16_t port,
+                              int sec_tag)
+{
+#ifdef CONFIG_APP_COAPS
+    init_reconnect(proxy);
+
+    int rc = coap_client_start_secure(&proxy->client, peer_addr, port, sec_tag);
+    if (rc == 0 || rc == -EINVAL || rc == -ENOTSUP) {
+        return rc;
+    }
+
+    // The peer is unreachable for now. Start disconnected, so that messages
+    // are deferred to the backlog until the session is up.
+    LOG_WRN("Peer unreachable, connecting in the background: %d", rc);
+    start_reconnect(proxy, K_MSEC(CONFIG_APP_OUTBOUND_QUEUE_RETRY_MIN_MS));
+
+    return 0;
+#else
+    return coap_client_start_secure(&proxy->client, peer_addr, port, sec_tag);
+#endif
+}
+
 int server_proxy_stop(server_proxy_t *proxy)
 {
+#ifdef CONFIG_APP_COAPS
+    if (proxy->client.sec_tag >= 0) {
+        struct k_work_sync sync;
+        k_work_cancel_delayable_sync(&proxy->reconnect, &sync);
+    }
+#endif
+
     return coap_client_stop(&proxy->client);
 }
 
-int server_proxy_print(server_proxy_t *proxy, const char *const message, k_timeout_t timeout)
+int server_proxy_set_backlog(server_proxy_t *proxy, outbound_queue_t *backlog)
 {
-    static const char *const PATH[] = { "print", NULL };
-    int rc = coap_client_put(&proxy->client, PATH, (const uint8_t *)message, strlen(message) + 1);
+    if (proxy == NULL || backlog == NULL) {
+        return -EINVAL;
+    }
+
+    if (proxy->backlog == NULL) {
+        sys_slist_append(&backlogged, &proxy->node);
+    }
+
+    proxy->backlog = backlog;
+    proxy->backoff_ms = 0;
+    proxy->retry_at = 0;
+
+    return 0;
+}
+
+int server_proxy_try_print_send(server_proxy_t *proxy, const char *const message, int *request)
+{
+    if (atomic_get(&proxy->disconnected)) {
+        return -ENOTCONN;
+    }
+
+    int rc = send_print(proxy, message);
     if (rc < 0) {
         return rc;
     }
 
-    struct coap_packet reply;
-    rc = coap_client_wait_and_receive(&proxy->client, &reply, sketch, sizeof(sketch), timeout);
-    if (rc < 0) {
+    *request = rc;
+
+    return 0;
+}
+
+int server_proxy_try_print_wait(server_proxy_t *proxy, int request, k_timeout_t timeout)
+{
+    return wait_print(proxy, request, timeout);
+}
+
+int server_proxy_print_send(server_proxy_t *proxy, const char *const message, int *request)
+{
+    // Queue behind older messages until the backlog has been drained.
+    if (server_proxy_has_backlog(proxy)) {
+        return server_proxy_defer(proxy, message);
+    }
+
+    int rc = server_proxy_try_print_send(proxy, message, request);
+    if (proxy->backlog != NULL && server_proxy_is_retryable(rc)) {
+        return server_proxy_defer(proxy, message);
+    }
+
+    return rc;
+}
+
+int server_proxy_print_wait(server_proxy_t *proxy, int request, const char *const message,
+                            k_timeout_t timeout)
+{
+    int rc = server_proxy_try_print_wait(proxy, request, timeout);
+    if (proxy->backlog != NULL && server_proxy_is_retryable(rc)) {
+        return server_proxy_defer(proxy, message);
+    }
+
+    return rc;
+}
+
+int server_proxy_print(server_proxy_t *proxy, const char *const message, k_timeout_t timeout)
+{
+    int request;
+    int rc = server_proxy_print_send(proxy, message, &request);
+    if (rc != 0) {
         return rc;
     }
 
-    if (coap_header_get_code(&reply) != COAP_RESPONSE_CODE_CHANGED) {
-        return -EIO;
+    return server_proxy_print_wait(proxy, request, message, timeout);
+}
+
+int server_proxy_drain_backlogs(k_timeout_t timeout)
+{
+    server_proxy_t *proxy;
+    int64_t now = k_uptime_get();
+    int drained = 0;
+
+    SYS_SLIST_FOR_EACH_CONTAINER (&backlogged, proxy, node) {
+        if (now < proxy->retry_at || outbound_queue_count(proxy->backlog) == 0) {
+            continue;
+        }
+
+        if (atomic_get(&proxy->disconnected)) {
+            // Look again shortly, the session is reestablished in the background.
+            proxy->retry_at = now + CONFIG_APP_OUTBOUND_QUEUE_RETRY_MIN_MS;
+            continue;
+        }
+
+        int rc = drain(proxy, timeout);
+        if (rc < 0) {
+            LOG_WRN("Peer still unreachable, retrying in %u ms", proxy->backoff_ms);
+            continue;
+        }
+
+        LOG_INF("Drained %d backlogged messages, %zu left", rc,
+                outbound_queue_count(proxy->backlog));
+        drained += rc;
     }
 
-    return 0;
+    return drained;
+}
+
+int64_t server_proxy_backlog_retry_at(void)
+{
+    server_proxy_t *proxy;
+    int64_t retry_at = -1;
+
+    SYS_SLIST_FOR_EACH_CONTAINER (&backlogged, proxy, node) {
+        if (outbound_queue_count(proxy->backlog) == 0) {
+            continue;
+        }
+
+        if (retry_at < 0 || proxy->retry_at < retry_at) {
+            retry_at = proxy->retry_at;
+        }
+    }
+
+    return retry_at;
 }
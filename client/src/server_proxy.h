@@ -7,10 +7,36 @@
 #ifndef SERVER_PROXY_H
 #define SERVER_PROXY_H
 
+#include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/slist.h>
+
+#include <errno.h>
+
 #include "coap_client.h"
+#include "outbound_queue.h"
+
+/** Returned when a message has been deferred to the backlog of the proxy. */
+#define SERVER_PROXY_DEFERRED 1
+
+/**
+ * Returned when the server answered 5.03 Service Unavailable to apply
+ * backpressure, and when the client has no free request slot. Worth retrying
+ * later, but says nothing about the health of the peer.
+ */
+#define SERVER_PROXY_BUSY (-EBUSY)
 
 typedef struct {
     coap_client_t client;
+    outbound_queue_t *backlog; // Messages deferred while the peer is unreachable, or NULL
+    int64_t retry_at; // Uptime (ms) of the next attempt to drain the backlog
+    uint32_t backoff_ms; // Current backoff between drain attempts
+    sys_snode_t node;
+    atomic_t disconnected; // Set while the DTLS session is being reestablished
+#ifdef CONFIG_APP_COAPS
+    struct k_work_delayable reconnect; // Reestablishes the DTLS session off the transmit path
+    uint32_t reconnect_backoff_ms; // Current backoff between reconnect attempts
+#endif
 } server_proxy_t;
 
 /**
@@ -23,6 +49,23 @@ typedef struct {
  */
 int server_proxy_start(server_proxy_t *proxy, const char *const peer_addr, uint16_t port);
 
+/**
+ * @brief Initiate and start the specified server proxy over DTLS (CoAPS).
+ *
+ * If the handshake fails, e.g. because the peer is down at boot, the proxy
+ * still starts, disconnected. The session is then established in the
+ * background, and messages are deferred to the backlog until it is up.
+ * 
+ * @param proxy The server proxy to start.
+ * @param peer_addr The address of the peer to connect to.
+ * @param port The port of the peer to connect to.
+ * @param sec_tag The security tag of the DTLS credentials to use.
+ * @return int 0 if successful or connecting in the background, otherwise a
+ * negative error code.
+ */
+int server_proxy_start_secure(server_proxy_t *proxy, const char *const peer_addr, uint16_t port,
+                              int sec_tag);
+
 /**
  * @brief Stop the specified server proxy.
  * 
@@ -37,8 +80,124 @@ int server_proxy_stop(server_proxy_t *proxy);
  * @param proxy The server proxy to use.
  * @param message The message to print.
  * @param timeout The timeout for the operation.
- * @return int 0 if successful, otherwise a negative error code.
+ * @return int 0 if successful, SERVER_PROXY_DEFERRED if the message was queued
+ * in the backlog, otherwise a negative error code.
  */
 int server_proxy_print(server_proxy_t *proxy, const char *const message, k_timeout_t timeout);
 
+/**
+ * @brief Send a print request without waiting for the reply.
+ *
+ * Must be followed by a call to server_proxy_print_wait() to collect the reply,
+ * unless the message was deferred.
+ * 
+ * @param proxy The server proxy to use.
+ * @param message The message to print.
+ * @param request Set to the handle of the request if it was sent.
+ * @return int 0 if successful, SERVER_PROXY_DEFERRED if the message was queued
+ * in the backlog, otherwise a negative error code.
+ */
+int server_proxy_print_send(server_proxy_t *proxy, const char *const message, int *request);
+
+/**
+ * @brief Wait for the reply to a print request sent with server_proxy_print_send().
+ * 
+ * Requests sent back-to-back may be waited for in any order.
+ * 
+ * @param proxy The server proxy to use.
+ * @param request The handle set by server_proxy_print_send().
+ * @param message The message that was sent, deferred to the backlog on failure.
+ * @param timeout The timeout to wait for the reply.
+ * @return int 0 if successful, SERVER_PROXY_DEFERRED if the message was queued
+ * in the backlog, otherwise a negative error code.
+ */
+int server_proxy_print_wait(server_proxy_t *proxy, int request, const char *const message,
+                            k_timeout_t timeout);
+
+/**
+ * @brief Send a print request without deferring it on failure.
+ *
+ * For callers that retry elsewhere first, such as a proxy group. The backlog
+ * of the proxy, if any, is not consulted.
+ *
+ * @param proxy The server proxy to use.
+ * @param message The message to print.
+ * @param request Set to the handle of the request if it was sent.
+ * @return int 0 if successful, otherwise a negative error code.
+ */
+int server_proxy_try_print_send(server_proxy_t *proxy, const char *const message, int *request);
+
+/**
+ * @brief Wait for the reply to a request sent with server_proxy_try_print_send().
+ *
+ * @param proxy The server proxy to use.
+ * @param request The handle set by server_proxy_try_print_send().
+ * @param timeout The timeout to wait for the reply.
+ * @return int 0 if successful, SERVER_PROXY_BUSY if the server applied
+ * backpressure, otherwise a negative error code.
+ */
+int server_proxy_try_print_wait(server_proxy_t *proxy, int request, k_timeout_t timeout);
+
+/**
+ * @brief Defer a message to the backlog of the specified server proxy.
+ *
+ * @param proxy The server proxy to use.
+ * @param message The message to defer.
+ * @return int SERVER_PROXY_DEFERRED if successful, -ENOTSUP if the proxy has
+ * no backlog, otherwise a negative error code.
+ */
+int server_proxy_defer(server_proxy_t *proxy, const char *const message);
+
+/**
+ * @brief Check whether the specified server proxy has messages in its backlog.
+ *
+ * New messages must not be sent to such a proxy before its backlog has been
+ * drained, or they would overtake older ones.
+ *
+ * @param proxy The server proxy to check.
+ * @return true if the backlog holds at least one message.
+ */
+bool server_proxy_has_backlog(server_proxy_t *proxy);
+
+/**
+ * @brief Check whether a failed request is worth retrying.
+ *
+ * A rejected message will be rejected again, so only transport failures and
+ * SERVER_PROXY_BUSY are worth deferring or retrying elsewhere.
+ * 
+ * @param rc The result of the request.
+ * @return true if the request failed for a reason other than a rejection.
+ */
+bool server_proxy_is_retryable(int rc);
+
+/**
+ * @brief Attach a backlog to the specified server proxy.
+ *
+ * Messages that cannot be delivered because the peer is unreachable are
+ * deferred to the backlog and resent by server_proxy_drain_backlogs().
+ * 
+ * @param proxy The server proxy to use.
+ * @param backlog The initialized outbound queue to defer messages to.
+ * @return int 0 if successful, otherwise a negative error code.
+ */
+int server_proxy_set_backlog(server_proxy_t *proxy, outbound_queue_t *backlog);
+
+/**
+ * @brief Resend backlogged messages of all server proxies that are due for a retry.
+ *
+ * At most CONFIG_APP_OUTBOUND_QUEUE_DRAIN_BUDGET messages are resent per proxy
+ * and call. A proxy whose peer is still unreachable backs off exponentially.
+ * 
+ * @param timeout The timeout to wait for each reply.
+ * @return int The number of messages drained.
+ */
+int server_proxy_drain_backlogs(k_timeout_t timeout);
+
+/**
+ * @brief Get the time of the next backlog drain attempt.
+ * 
+ * @return int64_t Uptime (ms) of the earliest retry, or -1 if all backlogs are empty.
+ */
+int64_t server_proxy_backlog_retry_at(void);
+
 #endif // SERVER_PROXY_H
\ No newline at end of file
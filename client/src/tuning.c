@@ -0,0 +1,643 @@
+/*
+ * Copyright (c) 2024 Albin Hjalmas (albin@bitman.se)
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/logging/log_ctrl.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef CONFIG_APP_TUNING_SETTINGS
+#include <zephyr/settings/settings.h>
+#endif
+
+#ifdef CONFIG_APP_TUNING_SHELL
+#include <zephyr/shell/shell.h>
+#endif
+
+#ifdef CONFIG_APP_TUNING_COAP
+#include <zephyr/net/coap.h>
+#include <zephyr/net/coap_service.h>
+#endif
+
+#include "tuning.h"
+
+LOG_MODULE_REGISTER(tuning, LOG_LEVEL_INF);
+
+#define SETTINGS_ROOT "tune"
+#define MAX_KEY_LEN 48
+
+typedef struct {
+    const char *name;
+    int32_t *value;
+    int32_t min;
+    int32_t max;
+    tuning_apply_t apply;
+} param_t;
+
+typedef struct {
+    const char *name;
+    const uint32_t *value;
+} counter_t;
+
+static K_MUTEX_DEFINE(table_lock);
+static param_t params[CONFIG_APP_TUNING_MAX_PARAMS];
+static size_t param_count;
+static counter_t counters[CONFIG_APP_TUNING_MAX_COUNTERS];
+static size_t counter_count;
+
+static param_t *find_param(const char *name)
+{
+    for (size_t i = 0; i < param_count; i++) {
+        if (strcmp(params[i].name, name) == 0) {
+            return &params[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Check whether a name is taken, by a parameter or a counter.
+ *
+ * Both are listed by name, so a name may only be used once.
+ */
+static bool name_taken(const char *name)
+{
+    if (find_param(name) != NULL) {
+        return true;
+    }
+
+    for (size_t i = 0; i < counter_count; i++) {
+        if (strcmp(counters[i].name, name) == 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+#if defined(CONFIG_APP_TUNING_SHELL) || defined(CONFIG_APP_TUNING_COAP)
+/**
+ * @brief Parse a decimal value, rejecting trailing garbage.
+ */
+static int parse_value(const char *str, int32_t *value)
+{
+    char *end;
+
+    errno = 0;
+    long parsed = strtol(str, &end, 10);
+    if (errno != 0 || end == str || *end != '\0' || parsed < INT32_MIN || parsed > INT32_MAX) {
+        return -EINVAL;
+    }
+
+    *value = (int32_t)parsed;
+
+    return 0;
+}
+#endif
+
+#ifdef CONFIG_APP_TUNING_SETTINGS
+static int load_param(const char *key, size_t len, settings_read_cb read_cb, void *cb_arg,
+                      void *user_data)
+{
+    param_t *param = user_data;
+    int32_t value;
+
+    if (len != sizeof(value) || read_cb(cb_arg, &value, sizeof(value)) != sizeof(value)) {
+        LOG_WRN("Ignoring malformed stored value of %s", param->name);
+        return 0;
+    }
+
+    // The range may have shrunk since the value was stored.
+    if (value < param->min || value > param->max) {
+        LOG_WRN("Ignoring stored value %d of %s, out of range", value, param->name);
+        return 0;
+    }
+
+    *param->value = value;
+    LOG_INF("Loaded %s = %d", param->name, value);
+
+    return 0;
+}
+
+static int init_settings(void)
+{
+    static bool initialized;
+
+    if (initialized) {
+        return 0;
+    }
+
+    int rc = settings_subsys_init();
+    if (rc < 0) {
+        LOG_ERR("Failed to initialize settings: %d", rc);
+        return rc;
+    }
+
+    initialized = true;
+
+    return 0;
+}
+#endif // CONFIG_APP_TUNING_SETTINGS
+
+static int add_param(const char *name, int32_t *value, int32_t min, int32_t max,
+                     tuning_apply_t apply)
+{
+    if (name == NULL || value == NULL || min > max || *value < min || *value > max) {
+        return -EINVAL;
+    }
+
+    k_mutex_lock(&table_lock, K_FOREVER);
+
+    if (name_taken(name)) {
+        k_mutex_unlock(&table_lock);
+        return -EALREADY;
+    }
+
+    if (param_count == ARRAY_SIZE(params)) {
+        k_mutex_unlock(&table_lock);
+        return -ENOMEM;
+    }
+
+    param_t *param = &params[param_count++];
+    *param = (param_t){ .name = name, .value = value, .min = min, .max = max, .apply = apply };
+
+    int32_t initial = *value;
+
+#ifdef CONFIG_APP_TUNING_SETTINGS
+    char key[MAX_KEY_LEN];
+
+    if (init_settings() == 0) {
+        snprintf(key, sizeof(key), SETTINGS_ROOT "/%s", name);
+        settings_load_subtree_direct(key, load_param, param);
+    }
+#endif
+
+    int32_t loaded = *value;
+
+    k_mutex_unlock(&table_lock);
+
+    // The owner already uses the default.
+    if (apply != NULL && loaded != initial) {
+        apply(loaded);
+    }
+
+    return 0;
+}
+
+static int add_counter(const char *name, const uint32_t *value)
+{
+    if (name == NULL || value == NULL) {
+        return -EINVAL;
+    }
+
+    k_mutex_lock(&table_lock, K_FOREVER);
+
+    if (name_taken(name)) {
+        k_mutex_unlock(&table_lock);
+        return -EALREADY;
+    }
+
+    if (counter_count == ARRAY_SIZE(counters)) {
+        k_mutex_unlock(&table_lock);
+        return -ENOMEM;
+    }
+
+    counters[counter_count++] = (counter_t){ .name = name, .value = value };
+
+    k_mutex_unlock(&table_lock);
+
+    return 0;
+}
+
+int tuning_param_register(const char *name, int32_t *value, int32_t min, int32_t max,
+                          tuning_apply_t apply)
+{
+    int rc = add_param(name, value, min, max, apply);
+    if (rc < 0) {
+        // The parameter keeps working with its default, it just cannot be tuned.
+        LOG_ERR("Failed to register parameter %s: %d", name != NULL ? name : "", rc);
+    }
+
+    return rc;
+}
+
+int tuning_counter_register(const char *name, const uint32_t *value)
+{
+    int rc = add_counter(name, value);
+    if (rc < 0) {
+        LOG_ERR("Failed to register counter %s: %d", name != NULL ? name : "", rc);
+    }
+
+    return rc;
+}
+
+int tuning_get(const char *name, int32_t *value)
+{
+    int rc = 0;
+
+    k_mutex_lock(&table_lock, K_FOREVER);
+
+    param_t *param = find_param(name);
+    if (param == NULL) {
+        rc = -ENOENT;
+    } else {
+        *value = *param->value;
+    }
+
+    k_mutex_unlock(&table_lock);
+
+    return rc;
+}
+
+int tuning_set(const char *name, int32_t value)
+{
+    k_mutex_lock(&table_lock, K_FOREVER);
+
+    param_t *param = find_param(name);
+    if (param == NULL) {
+        k_mutex_unlock(&table_lock);
+        return -ENOENT;
+    }
+
+    if (value < param->min || value > param->max) {
+        k_mutex_unlock(&table_lock);
+        return -ERANGE;
+    }
+
+    *param->value = value;
+    tuning_apply_t apply = param->apply;
+
+    k_mutex_unlock(&table_lock);
+
+    if (apply != NULL) {
+        apply(value);
+    }
+
+    LOG_INF("Set %s = %d", name, value);
+
+#ifdef CONFIG_APP_TUNING_SETTINGS
+    char key[MAX_KEY_LEN];
+
+    snprintf(key, sizeof(key), SETTINGS_ROOT "/%s", name);
+
+    int rc = settings_save_one(key, &value, sizeof(value));
+    if (rc < 0) {
+        LOG_WRN("Failed to persist %s: %d", name, rc);
+        return rc;
+    }
+#endif
+
+    return 0;
+}
+
+int tuning_set_log_level(const char *module, uint32_t level)
+{
+#ifdef CONFIG_LOG_RUNTIME_FILTERING
+    if (level > LOG_LEVEL_DBG) {
+        return -ERANGE;
+    }
+
+    int source_id = log_source_id_get(module);
+    if (source_id < 0) {
+        return -ENOENT;
+    }
+
+    log_filter_set(NULL, Z_LOG_LOCAL_DOMAIN_ID, source_id, level);
+    LOG_INF("Log level of %s set to %u", module, level);
+
+    return 0;
+#else
+    ARG_UNUSED(module);
+    ARG_UNUSED(level);
+
+    return -ENOTSUP;
+#endif
+}
+
+#ifdef CONFIG_APP_TUNING_SHELL
+static int cmd_list(const struct shell *sh, size_t argc, char **argv)
+{
+    k_mutex_lock(&table_lock, K_FOREVER);
+
+    for (size_t i = 0; i < param_count; i++) {
+        shell_print(sh, "%-24s %10d  [%d, %d]", params[i].name, *params[i].value, params[i].min,
+                    params[i].max);
+    }
+
+    k_mutex_unlock(&table_lock);
+
+    return 0;
+}
+
+static int cmd_get(const struct shell *sh, size_t argc, char **argv)
+{
+    int32_t value;
+
+    int rc = tuning_get(argv[1], &value);
+    if (rc < 0) {
+        shell_error(sh, "Unknown parameter %s", argv[1]);
+        return rc;
+    }
+
+    shell_print(sh, "%s = %d", argv[1], value);
+
+    return 0;
+}
+
+static int cmd_set(const struct shell *sh, size_t argc, char **argv)
+{
+    int32_t value;
+
+    int rc = parse_value(argv[2], &value);
+    if (rc < 0) {
+        shell_error(sh, "Invalid value %s", argv[2]);
+        return rc;
+    }
+
+    rc = tuning_set(argv[1], value);
+    if (rc == -ENOENT) {
+        shell_error(sh, "Unknown parameter %s", argv[1]);
+    } else if (rc == -ERANGE) {
+        shell_error(sh, "Value out of range");
+    } else if (rc < 0) {
+        shell_warn(sh, "Applied, but not persisted: %d", rc);
+    }
+
+    return rc;
+}
+
+static int cmd_counters(const struct shell *sh, size_t argc, char **argv)
+{
+    k_mutex_lock(&table_lock, K_FOREVER);
+
+    for (size_t i = 0; i < counter_count; i++) {
+        shell_print(sh, "%-24s %10u", counters[i].name, *counters[i].value);
+    }
+
+    k_mutex_unlock(&table_lock);
+
+    return 0;
+}
+
+static int cmd_log(const struct shell *sh, size_t argc, char **argv)
+{
+    int32_t level;
+
+    int rc = parse_value(argv[2], &level);
+    if (rc < 0 || level < 0) {
+        shell_error(sh, "Invalid level %s", argv[2]);
+        return -EINVAL;
+    }
+
+    rc = tuning_set_log_level(argv[1], level);
+    if (rc < 0) {
+        shell_error(sh, "Failed to set log level: %d", rc);
+    }
+
+    return rc;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(
+        tune_cmds, SHELL_CMD_ARG(list, NULL, "List the parameters", cmd_list, 1, 0),
+        SHELL_CMD_ARG(get, NULL, "<name>", cmd_get, 2, 0),
+        SHELL_CMD_ARG(set, NULL, "<name> <value>", cmd_set, 3, 0),
+        SHELL_CMD_ARG(counters, NULL, "Dump the counters", cmd_counters, 1, 0),
+        SHELL_CMD_ARG(log, NULL, "<module> <level 0-4>", cmd_log, 3, 0), SHELL_SUBCMD_SET_END);
+
+SHELL_CMD_REGISTER(tune, &tune_cmds, "Runtime tuning", NULL);
+#endif // CONFIG_APP_TUNING_SHELL
+
+#ifdef CONFIG_APP_TUNING_COAP
+// The resources may also be served by the CoAPS and OSCORE endpoint threads.
+static K_MUTEX_DEFINE(coap_lock);
+static tuning_secured_t coap_is_secured; // Check for PUT /config, none refuses every PUT
+static uint8_t response_buf[CONFIG_COAP_SERVER_MESSAGE_SIZE];
+static char text_buf[CONFIG_COAP_SERVER_MESSAGE_SIZE - 32];
+
+/**
+ * @brief Apply a "name=value" assignment, as received over the management channel.
+ *
+ * "log.<module>=<level>" changes a log level, anything else a parameter.
+ */
+static int assign(char *assignment)
+{
+    static const char LOG_PREFIX[] = "log.";
+
+    int32_t value;
+    char *eq = strchr(assignment, '=');
+
+    if (eq == NULL) {
+        return -EINVAL;
+    }
+
+    *eq = '\0';
+
+    int rc = parse_value(eq + 1, &value);
+    if (rc < 0) {
+        return rc;
+    }
+
+    if (strncmp(assignment, LOG_PREFIX, sizeof(LOG_PREFIX) - 1) == 0) {
+        return value < 0 ? -ERANGE :
+                           tuning_set_log_level(&assignment[sizeof(LOG_PREFIX) - 1], value);
+    }
+
+    return tuning_set(assignment, value);
+}
+
+/**
+ * @brief Format the parameters or the counters, one "name=value" line each.
+ *
+ * @param from Index of the first entry to format.
+ * @param next Set to the index of the first entry that did not fit, or the
+ * number of entries if all did.
+ * @return size_t The number of characters written, excluding the terminator.
+ */
+static size_t format_table(bool metrics, size_t from, char *buf, size_t len, size_t *next)
+{
+    size_t offset = 0;
+    size_t i;
+
+    k_mutex_lock(&table_lock, K_FOREVER);
+
+    size_t count = metrics ? counter_count : param_count;
+
+    for (i = from; i < count; i++) {
+        int n = metrics ? snprintf(&buf[offset], len - offset, "%s=%u\n", counters[i].name,
+                                   *counters[i].value) :
+                          snprintf(&buf[offset], len - offset, "%s=%d\n", params[i].name,
+                                   *params[i].value);
+        if (n < 0 || (size_t)n >= len - offset) {
+            break;
+        }
+
+        offset += n;
+    }
+
+    k_mutex_unlock(&table_lock);
+
+    buf[offset] = '\0';
+    *next = i;
+
+    return offset;
+}
+
+/**
+ * @brief Answer a GET with a page of the parameters or the counters.
+ *
+ * The listing may not fit a single message. The "from=<n>" query selects the
+ * first entry, and a truncated page ends with a "next=<n>" line.
+ */
+static int send_table(struct coap_resource *resource, struct coap_packet *request,
+                      struct sockaddr *addr, socklen_t addr_len, bool metrics)
+{
+    static const char FROM[] = "from=";
+
+    struct coap_packet response;
+    struct coap_option query;
+    uint8_t token[COAP_TOKEN_MAX_LEN];
+    size_t from = 0;
+    size_t next;
+    size_t count;
+
+    if (coap_find_options(request, COAP_OPTION_URI_QUERY, &query, 1) == 1 &&
+        query.len > sizeof(FROM) - 1 && memcmp(query.value, FROM, sizeof(FROM) - 1) == 0) {
+        char digits[8] = { 0 };
+        memcpy(digits, &query.value[sizeof(FROM) - 1],
+               MIN(query.len - (sizeof(FROM) - 1), sizeof(digits) - 1));
+        from = strtoul(digits, NULL, 10);
+    }
+
+    // Leave room for the "next=" line.
+    size_t len = format_table(metrics, from, text_buf, sizeof(text_buf) - 16, &next);
+
+    k_mutex_lock(&table_lock, K_FOREVER);
+    count = metrics ? counter_count : param_count;
+    k_mutex_unlock(&table_lock);
+
+    if (next < count) {
+        len += snprintf(&text_buf[len], sizeof(text_buf) - len, "next=%zu\n", next);
+    }
+
+    uint8_t tkl = coap_header_get_token(request, token);
+    uint8_t type = coap_header_get_type(request) == COAP_TYPE_CON ? COAP_TYPE_ACK :
+                                                                    COAP_TYPE_NON_CON;
+
+    int rc = coap_packet_init(&response, response_buf, sizeof(response_buf), COAP_VERSION_1, type,
+                              tkl, token, COAP_RESPONSE_CODE_CONTENT,
+                              coap_header_get_id(request));
+    if (rc == 0) {
+        rc = coap_append_option_int(&response, COAP_OPTION_CONTENT_FORMAT,
+                                    COAP_CONTENT_FORMAT_TEXT_PLAIN);
+    }
+
+    if (rc == 0) {
+        rc = coap_packet_append_payload_marker(&response);
+    }
+
+    if (rc == 0) {
+        rc = coap_packet_append_payload(&response, (const uint8_t *)text_buf, len);
+    }
+
+    if (rc < 0) {
+        LOG_ERR("Failed to build response: %d", rc);
+        return COAP_RESPONSE_CODE_INTERNAL_ERROR;
+    }
+
+    return coap_resource_send(resource, &response, addr, addr_len, NULL);
+}
+
+static int config_get(struct coap_resource *resource, struct coap_packet *request,
+                      struct sockaddr *addr, socklen_t addr_len)
+{
+    k_mutex_lock(&coap_lock, K_FOREVER);
+    int rc = send_table(resource, request, addr, addr_len, false);
+    k_mutex_unlock(&coap_lock);
+
+    return rc;
+}
+
+static int apply_assignments(const uint8_t *payload, uint16_t payload_len)
+{
+    if (payload == NULL || payload_len == 0 || payload_len >= sizeof(text_buf)) {
+        return COAP_RESPONSE_CODE_BAD_REQUEST;
+    }
+
+    memcpy(text_buf, payload, payload_len);
+    text_buf[payload_len] = '\0';
+
+    // One assignment per line, applied in order up to the first failure.
+    char *save;
+    for (char *line = strtok_r(text_buf, "\n", &save); line != NULL;
+         line = strtok_r(NULL, "\n", &save)) {
+        int rc = assign(line);
+        if (rc == -ENOENT) {
+            return COAP_RESPONSE_CODE_NOT_FOUND;
+        }
+
+        if (rc == -EINVAL || rc == -ERANGE) {
+            return COAP_RESPONSE_CODE_BAD_REQUEST;
+        }
+
+        if (rc == -ENOTSUP) {
+            return COAP_RESPONSE_CODE_NOT_IMPLEMENTED;
+        }
+    }
+
+    return COAP_RESPONSE_CODE_CHANGED;
+}
+
+static int config_put(struct coap_resource *resource, struct coap_packet *request,
+                      struct sockaddr *addr, socklen_t addr_len)
+{
+    tuning_secured_t is_secured = coap_is_secured;
+    if (is_secured == NULL || !is_secured()) {
+        LOG_WRN("Refusing PUT /config received over plaintext CoAP");
+        return COAP_RESPONSE_CODE_UNAUTHORIZED;
+    }
+
+    uint16_t payload_len;
+    const uint8_t *payload = coap_packet_get_payload(request, &payload_len);
+
+    k_mutex_lock(&coap_lock, K_FOREVER);
+    int rc = apply_assignments(payload, payload_len);
+    k_mutex_unlock(&coap_lock);
+
+    return rc;
+}
+
+static int metrics_get(struct coap_resource *resource, struct coap_packet *request,
+                       struct sockaddr *addr, socklen_t addr_len)
+{
+    k_mutex_lock(&coap_lock, K_FOREVER);
+    int rc = send_table(resource, request, addr, addr_len, true);
+    k_mutex_unlock(&coap_lock);
+
+    return rc;
+}
+
+void tuning_coap_set_auth(tuning_secured_t is_secured)
+{
+    coap_is_secured = is_secured;
+}
+
+static const char *const CONFIG_PATH[] = { "config", NULL };
+COAP_RESOURCE_DEFINE(config, coap_server,
+                     { .get = config_get, .put = config_put, .path = CONFIG_PATH });
+
+static const char *const METRICS_PATH[] = { "metrics", NULL };
+COAP_RESOURCE_DEFINE(metrics, coap_server, { .get = metrics_get, .path = METRICS_PATH });
+#else
+void tuning_coap_set_auth(tuning_secured_t is_secured)
+{
+    ARG_UNUSED(is_secured);
+}
+#endif // CONFIG_APP_TUNING_COAP
@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2024 Albin Hjalmas (albin@bitman.se)
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef TUNING_H
+#define TUNING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * @brief Called after a parameter has been changed, to apply the new value.
+ */
+typedef void (*tuning_apply_t)(int32_t value);
+
+/**
+ * @brief Called from a CoAP request handler, to tell whether the request
+ * being handled arrived over a secured endpoint.
+ */
+typedef bool (*tuning_secured_t)(void);
+
+#ifdef CONFIG_APP_TUNING
+
+/**
+ * @brief Make a parameter tunable at runtime.
+ *
+ * The parameter is owned by the caller, which keeps reading it directly. It
+ * is an aligned 32-bit word, so it can be changed without locking. A value
+ * stored by an earlier run is loaded before this function returns. Failures
+ * are logged, so callers may ignore them: the parameter keeps its default.
+ *
+ * @param name The name of the parameter, e.g. "tx.window_ms". Must stay valid.
+ * @param value The parameter, initialized to its default.
+ * @param min The smallest accepted value.
+ * @param max The largest accepted value.
+ * @param apply Called after the value has been changed, or NULL.
+ * @return int 0 if successful, -EALREADY if a parameter or counter has the
+ * same name, -ENOMEM if the table is full, otherwise a negative error code.
+ */
+int tuning_param_register(const char *name, int32_t *value, int32_t min, int32_t max,
+                          tuning_apply_t apply);
+
+/**
+ * @brief Export a counter.
+ *
+ * Counters are read without locking, so a value may lag by one update.
+ * Failures are logged.
+ *
+ * @param name The name of the counter, e.g. "tx.messages". Must stay valid.
+ * @param value The counter.
+ * @return int 0 if successful, -EALREADY if a parameter or counter has the
+ * same name, -ENOMEM if the table is full, otherwise a negative error code.
+ */
+int tuning_counter_register(const char *name, const uint32_t *value);
+
+/**
+ * @brief Get the value of a parameter.
+ *
+ * @param name The name of the parameter.
+ * @param value Destination for the value.
+ * @return int 0 if successful, -ENOENT if there is no such parameter.
+ */
+int tuning_get(const char *name, int32_t *value);
+
+/**
+ * @brief Change the value of a parameter and persist it.
+ *
+ * The value is applied even if it could not be persisted.
+ *
+ * @param name The name of the parameter.
+ * @param value The new value.
+ * @return int 0 if successful, -ENOENT if there is no such parameter,
+ * -ERANGE if the value is out of range, otherwise a negative error code.
+ */
+int tuning_set(const char *name, int32_t value);
+
+/**
+ * @brief Change the runtime log level of a log module.
+ *
+ * Log levels are not persisted.
+ *
+ * @param module The name the module was registered with.
+ * @param level The new level, LOG_LEVEL_NONE to LOG_LEVEL_DBG.
+ * @return int 0 if successful, -ENOENT if there is no such module, -ENOTSUP
+ * without CONFIG_LOG_RUNTIME_FILTERING, otherwise a negative error code.
+ */
+int tuning_set_log_level(const char *module, uint32_t level);
+
+/**
+ * @brief Set the check that lets a PUT /config request change parameters.
+ *
+ * The CoAP service itself is plaintext, so PUT /config is refused with 4.01
+ * Unauthorized unless the check accepts the request, and always until one is
+ * set. GET /config and GET /metrics are not affected. They are only served
+ * over plaintext CoAP, since the reply is sent on the CoAP service socket.
+ *
+ * @param is_secured The check, or NULL to refuse every PUT again.
+ */
+void tuning_coap_set_auth(tuning_secured_t is_secured);
+
+#else
+
+static inline int tuning_param_register(const char *name, int32_t *value, int32_t min,
+                                        int32_t max, tuning_apply_t apply)
+{
+    return 0;
+}
+
+static inline int tuning_counter_register(const char *name, const uint32_t *value)
+{
+    return 0;
+}
+
+static inline void tuning_coap_set_auth(tuning_secured_t is_secured)
+{
+}
+
+#endif // CONFIG_APP_TUNING
+
+#endif // TUNING_H
@@ -0,0 +1,449 @@
+/*
+ * Copyright (c) 2024 Albin Hjalmas (albin@bitman.se)
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/net/socket.h>
+
+#include <errno.h>
+#include <string.h>
+
+#include "tuning.h"
+#include "tx_scheduler.h"
+
+LOG_MODULE_REGISTER(tx_scheduler, LOG_LEVEL_INF);
+
+#define QUEUE_SIZE CONFIG_APP_TX_SCHEDULER_QUEUE_SIZE
+#define REPLY_TIMEOUT K_MSEC(reply_timeout_ms)
+#define METRICS_INTERVAL_MS (CONFIG_APP_TX_SCHEDULER_METRICS_INTERVAL_S * MSEC_PER_SEC)
+
+typedef enum {
+    TX_ENTRY_PRINT,
+    TX_ENTRY_DATAGRAM,
+} tx_entry_kind_t;
+
+typedef struct {
+    tx_entry_kind_t kind;
+    int64_t queued_at; // Uptime (ms) when the entry was queued
+    server_proxy_t *proxy; // Target of a print request
+    proxy_group_t *group; // Group to pick the target from at flush time, or NULL
+    int sock; // Socket of a datagram
+    struct sockaddr_in6 addr; // Destination of a datagram
+    uint16_t len;
+    uint8_t payload[CONFIG_APP_TX_SCHEDULER_PAYLOAD_SIZE];
+} tx_entry_t;
+
+K_MSGQ_DEFINE(tx_queue, sizeof(tx_entry_t), QUEUE_SIZE, 4);
+
+// Signalled when the queue goes from empty to non-empty.
+K_SEM_DEFINE(tx_pending, 0, 1);
+
+// Signalled when enough entries are queued to warrant an early flush.
+K_SEM_DEFINE(tx_batch_full, 0, 1);
+
+K_THREAD_STACK_DEFINE(tx_thread_stack, CONFIG_APP_TX_SCHEDULER_STACK_SIZE);
+static struct k_thread tx_thread_data;
+
+// Working set of the flush in progress. Only touched by the scheduler thread.
+static tx_entry_t batch[QUEUE_SIZE];
+static int results[QUEUE_SIZE];
+static int members[QUEUE_SIZE]; // Group member each print was sent to
+static int requests[QUEUE_SIZE]; // Handle of each print request in flight
+static int64_t sent_at[QUEUE_SIZE];
+
+// Tunable at runtime, see tuning.h.
+static int32_t window_ms = CONFIG_APP_TX_SCHEDULER_WINDOW_MS;
+static int32_t max_latency_ms = CONFIG_APP_TX_SCHEDULER_MAX_LATENCY_MS;
+static int32_t batch_size = CONFIG_APP_TX_SCHEDULER_BATCH_SIZE;
+static int32_t reply_timeout_ms = CONFIG_APP_TX_SCHEDULER_REPLY_TIMEOUT_MS;
+static int32_t max_attempts = CONFIG_APP_PROXY_GROUP_MAX_ATTEMPTS;
+static int32_t thread_priority = CONFIG_APP_TX_SCHEDULER_THREAD_PRIORITY;
+
+// The ranges of these parameters come from other options.
+BUILD_ASSERT(CONFIG_APP_TX_SCHEDULER_BATCH_SIZE >= 1 &&
+                     CONFIG_APP_TX_SCHEDULER_BATCH_SIZE <= QUEUE_SIZE,
+             "The batch size must be between 1 and the queue size");
+BUILD_ASSERT(CONFIG_APP_PROXY_GROUP_MAX_ATTEMPTS >= 1 &&
+                     CONFIG_APP_PROXY_GROUP_MAX_ATTEMPTS <= CONFIG_APP_PROXY_GROUP_MAX_MEMBERS,
+             "The attempts must be between 1 and the number of group members");
+
+static struct k_spinlock stats_lock;
+static tx_scheduler_stats_t stats;
+static int64_t metrics_start;
+static uint32_t metrics_wakeups;
+
+static int64_t next_window(int64_t now)
+{
+    int64_t window = window_ms;
+
+    return (now / window + 1) * window;
+}
+
+static void report_metrics(int64_t now)
+{
+    int64_t elapsed = now - metrics_start;
+    if (elapsed < METRICS_INTERVAL_MS) {
+        return;
+    }
+
+    tx_scheduler_stats_t snapshot;
+
+    k_spinlock_key_t key = k_spin_lock(&stats_lock);
+    stats.wakeups_per_minute =
+            (uint32_t)(((uint64_t)(stats.wakeups - metrics_wakeups) * 60 * MSEC_PER_SEC) /
+                       elapsed);
+    snapshot = stats;
+    k_spin_unlock(&stats_lock, key);
+
+    metrics_start = now;
+    metrics_wakeups = snapshot.wakeups;
+
+    LOG_INF("wakeups %u (%u/min), messages %u, failures %u, retries %u, deferred %u, "
+            "dropped %u, radio on %llu ms, max latency %u ms",
+            snapshot.wakeups, snapshot.wakeups_per_minute, snapshot.messages, snapshot.failures,
+            snapshot.retries, snapshot.deferred, snapshot.dropped, snapshot.radio_on_ms,
+            snapshot.max_latency_ms);
+}
+
+static k_timeout_t backlog_timeout(void)
+{
+    int64_t retry_at = server_proxy_backlog_retry_at();
+    if (retry_at < 0) {
+        return K_FOREVER;
+    }
+
+    return K_TIMEOUT_ABS_MS(next_window(retry_at));
+}
+
+/**
+ * @brief Send a group print to a member that has nothing backlogged.
+ *
+ * A member with a backlog is passed over, so that the print does not overtake
+ * older messages. If no other member is left, the print is deferred to the
+ * backlog of the first one passed over.
+ *
+ * @return int The result of the send, SERVER_PROXY_DEFERRED, or -EHOSTUNREACH
+ * if no member was selected.
+ */
+static int group_send(tx_entry_t *entry, size_t i, uint32_t exclude)
+{
+    server_proxy_t *backlogged = NULL;
+
+    while ((members[i] = proxy_group_select(entry->group, exclude, &entry->proxy)) >= 0) {
+        if (!server_proxy_has_backlog(entry->proxy)) {
+            sent_at[i] = k_uptime_get();
+
+            // Failures are reported to the group as they are, so that the member is
+            // held to account and the print fails over before it is deferred.
+            return server_proxy_try_print_send(entry->proxy, (const char *)entry->payload,
+                                               &requests[i]);
+        }
+
+        // Nothing was sent, so the health of the member is left alone.
+        proxy_group_complete(entry->group, members[i], entry->proxy, SERVER_PROXY_DEFERRED, 0);
+
+        if (backlogged == NULL) {
+            backlogged = entry->proxy;
+        }
+        exclude |= BIT(members[i]);
+    }
+
+    if (backlogged == NULL) {
+        return -EHOSTUNREACH;
+    }
+
+    entry->proxy = backlogged;
+    return server_proxy_defer(backlogged, (const char *)entry->payload);
+}
+
+/**
+ * @brief Report the outcome of a group print, retrying it on other members.
+ *
+ * Once every member, or max_attempts of them, failed to deliver it, the print
+ * is deferred to the backlog of the first member tried that has one.
+ *
+ * @return int The result of the last attempt, or SERVER_PROXY_DEFERRED.
+ */
+static int group_complete(tx_entry_t *entry, size_t i, int rc, uint32_t *retries)
+{
+    server_proxy_t *fallback = NULL;
+    uint32_t tried = 0;
+
+    for (int attempt = 1; members[i] >= 0; attempt++) {
+        if (fallback == NULL && entry->proxy->backlog != NULL) {
+            fallback = entry->proxy;
+        }
+
+        // Replies are collected after the whole batch has been sent, so the
+        // round-trip time of the first attempt is an upper bound.
+        proxy_group_complete(entry->group, members[i], entry->proxy, rc,
+                             (uint32_t)(k_uptime_get() - sent_at[i]));
+
+        if (!server_proxy_is_retryable(rc) || attempt >= max_attempts) {
+            break;
+        }
+
+        tried |= BIT(members[i]);
+
+        int retry = group_send(entry, i, tried);
+        if (members[i] < 0) {
+            if (retry == SERVER_PROXY_DEFERRED) {
+                rc = retry; // Queued behind the backlog of another member
+            }
+            break; // No other member to try
+        }
+
+        if (retry == 0) {
+            retry = server_proxy_try_print_wait(entry->proxy, requests[i], REPLY_TIMEOUT);
+        }
+
+        LOG_WRN("Retried print on member %d after %d: %d", members[i], rc, retry);
+        (*retries)++;
+        rc = retry;
+    }
+
+    if (fallback != NULL && server_proxy_is_retryable(rc)) {
+        rc = server_proxy_defer(fallback, (const char *)entry->payload);
+    }
+
+    return rc;
+}
+
+static void flush(void)
+{
+    size_t count = 0;
+
+    while (count < ARRAY_SIZE(batch) && k_msgq_get(&tx_queue, &batch[count], K_NO_WAIT) == 0) {
+        count++;
+    }
+
+    int64_t start = k_uptime_get();
+    uint32_t failures = 0;
+    uint32_t retries = 0;
+    uint32_t deferred = 0;
+
+    // Backlogged messages are older than anything queued since, so they go first.
+    int drained = server_proxy_drain_backlogs(REPLY_TIMEOUT);
+
+    if (count == 0 && drained == 0) {
+        return;
+    }
+
+    // Transmit phase. Every queued frame is sent back-to-back so that the whole
+    // batch is handled within a single radio active period.
+    for (size_t i = 0; i < count; i++) {
+        tx_entry_t *entry = &batch[i];
+
+        switch (entry->kind) {
+        case TX_ENTRY_PRINT:
+            if (entry->group != NULL) {
+                results[i] = group_send(entry, i, 0);
+            } else {
+                results[i] = server_proxy_print_send(entry->proxy, (const char *)entry->payload,
+                                                     &requests[i]);
+            }
+            break;
+        case TX_ENTRY_DATAGRAM:
+            results[i] = sendto(entry->sock, entry->payload, entry->len, 0,
+                                (struct sockaddr *)&entry->addr, sizeof(entry->addr));
+            results[i] = results[i] < 0 ? -errno : 0;
+            break;
+        }
+    }
+
+    // Reply phase. Collect the acknowledgements of the confirmable requests.
+    for (size_t i = 0; i < count; i++) {
+        tx_entry_t *entry = &batch[i];
+
+        if (entry->kind == TX_ENTRY_PRINT && entry->group != NULL) {
+            if (results[i] == 0) {
+                results[i] = server_proxy_try_print_wait(entry->proxy, requests[i],
+                                                         REPLY_TIMEOUT);
+            }
+
+            results[i] = group_complete(entry, i, results[i], &retries);
+        } else if (entry->kind == TX_ENTRY_PRINT && results[i] == 0) {
+            results[i] = server_proxy_print_wait(entry->proxy, requests[i],
+                                                 (const char *)entry->payload, REPLY_TIMEOUT);
+        }
+
+        if (results[i] == SERVER_PROXY_DEFERRED) {
+            LOG_WRN("Peer unreachable, message deferred to backlog");
+            deferred++;
+        } else if (results[i] < 0) {
+            LOG_ERR("Failed to transmit queued %s: %d",
+                    entry->kind == TX_ENTRY_PRINT ? "print" : "datagram", results[i]);
+            failures++;
+        }
+    }
+
+    int64_t end = k_uptime_get();
+    uint32_t latency = count > 0 ? (uint32_t)(start - batch[0].queued_at) : 0;
+
+    LOG_DBG("Flushed %zu requests and %d backlogged in %lld ms", count, drained, end - start);
+
+    k_spinlock_key_t key = k_spin_lock(&stats_lock);
+    stats.wakeups++;
+    stats.messages += count + drained;
+    stats.failures += failures;
+    stats.retries += retries;
+    stats.deferred += deferred;
+    stats.radio_on_ms += end - start;
+    stats.max_latency_ms = MAX(stats.max_latency_ms, latency);
+    k_spin_unlock(&stats_lock, key);
+
+    report_metrics(end);
+}
+
+static void tx_scheduler_thread(void *p1, void *p2, void *p3)
+{
+    ARG_UNUSED(p1);
+    ARG_UNUSED(p2);
+    ARG_UNUSED(p3);
+
+    tx_entry_t oldest;
+
+    while (1) {
+        if (k_msgq_num_used_get(&tx_queue) == 0 &&
+            k_sem_take(&tx_pending, backlog_timeout()) == -EAGAIN) {
+            // Nothing new to send, but a backlog is due for another attempt.
+            flush();
+            continue;
+        }
+
+        if (k_msgq_peek(&tx_queue, &oldest) < 0) {
+            continue;
+        }
+
+        // Hold the batch until the next aligned window, unless the oldest entry
+        // would exceed its latency budget or the batch fills up before that.
+        int64_t deadline = MIN(next_window(oldest.queued_at), oldest.queued_at + max_latency_ms);
+
+        k_sem_take(&tx_batch_full, K_TIMEOUT_ABS_MS(deadline));
+        k_sem_reset(&tx_batch_full);
+
+        flush();
+    }
+}
+
+static int submit(tx_entry_t *entry)
+{
+    entry->queued_at = k_uptime_get();
+
+    if (k_msgq_put(&tx_queue, entry, K_NO_WAIT) < 0) {
+        k_spinlock_key_t key = k_spin_lock(&stats_lock);
+        stats.dropped++;
+        k_spin_unlock(&stats_lock, key);
+        return -ENOBUFS;
+    }
+
+    k_sem_give(&tx_pending);
+
+    if (k_msgq_num_used_get(&tx_queue) >= batch_size) {
+        k_sem_give(&tx_batch_full);
+    }
+
+    return 0;
+}
+
+static void apply_priority(int32_t priority)
+{
+    k_thread_priority_set(&tx_thread_data, priority);
+}
+
+static void register_tunables(void)
+{
+    tuning_param_register("tx.window_ms", &window_ms, 1, 60 * MSEC_PER_SEC, NULL);
+    tuning_param_register("tx.max_latency_ms", &max_latency_ms, 0, 60 * MSEC_PER_SEC, NULL);
+    tuning_param_register("tx.batch_size", &batch_size, 1, QUEUE_SIZE, NULL);
+    tuning_param_register("tx.reply_timeout_ms", &reply_timeout_ms, 10, 10 * MSEC_PER_SEC, NULL);
+    tuning_param_register("tx.max_attempts", &max_attempts, 1, CONFIG_APP_PROXY_GROUP_MAX_MEMBERS,
+                          NULL);
+    tuning_param_register("tx.priority", &thread_priority, K_HIGHEST_APPLICATION_THREAD_PRIO,
+                          K_LOWEST_APPLICATION_THREAD_PRIO, apply_priority);
+
+    tuning_counter_register("tx.wakeups", &stats.wakeups);
+    tuning_counter_register("tx.messages", &stats.messages);
+    tuning_counter_register("tx.failures", &stats.failures);
+    tuning_counter_register("tx.retries", &stats.retries);
+    tuning_counter_register("tx.deferred", &stats.deferred);
+    tuning_counter_register("tx.dropped", &stats.dropped);
+    tuning_counter_register("tx.worst_latency_ms", &stats.max_latency_ms);
+    tuning_counter_register("tx.wakeups_per_minute", &stats.wakeups_per_minute);
+}
+
+int tx_scheduler_start(void)
+{
+    metrics_start = k_uptime_get();
+
+    k_thread_create(&tx_thread_data, tx_thread_stack, K_THREAD_STACK_SIZEOF(tx_thread_stack),
+                    tx_scheduler_thread, NULL, NULL, NULL, thread_priority, 0, K_NO_WAIT);
+
+    k_thread_name_set(&tx_thread_data, "tx_scheduler");
+
+    // Registered once the thread exists, so that a stored priority can be applied.
+    register_tunables();
+
+    return 0;
+}
+
+int tx_scheduler_print(server_proxy_t *proxy, const char *const message)
+{
+    if (proxy == NULL || message == NULL) {
+        return -EINVAL;
+    }
+
+    size_t len = strlen(message) + 1;
+    if (len > CONFIG_APP_TX_SCHEDULER_PAYLOAD_SIZE) {
+        return -EMSGSIZE;
+    }
+
+    tx_entry_t entry = { .kind = TX_ENTRY_PRINT, .proxy = proxy, .len = len };
+    memcpy(entry.payload, message, len);
+
+    return submit(&entry);
+}
+
+int tx_scheduler_print_group(proxy_group_t *group, const char *const message)
+{
+    if (group == NULL || message == NULL) {
+        return -EINVAL;
+    }
+
+    size_t len = strlen(message) + 1;
+    if (len > CONFIG_APP_TX_SCHEDULER_PAYLOAD_SIZE) {
+        return -EMSGSIZE;
+    }
+
+    tx_entry_t entry = { .kind = TX_ENTRY_PRINT, .group = group, .len = len };
+    memcpy(entry.payload, message, len);
+
+    return submit(&entry);
+}
+
+int tx_scheduler_sendto(int sock, const struct sockaddr_in6 *addr, const uint8_t *data,
+                        size_t len)
+{
+    if (sock < 0 || addr == NULL || data == NULL) {
+        return -EINVAL;
+    }
+
+    if (len > CONFIG_APP_TX_SCHEDULER_PAYLOAD_SIZE) {
+        return -EMSGSIZE;
+    }
+
+    tx_entry_t entry = { .kind = TX_ENTRY_DATAGRAM, .sock = sock, .addr = *addr, .len = len };
+    memcpy(entry.payload, data, len);
+
+    return submit(&entry);
+}
+
+void tx_scheduler_get_stats(tx_scheduler_stats_t *stats_out)
+{
+    k_spinlock_key_t key = k_spin_lock(&stats_lock);
+    *stats_out = stats;
+    k_spin_unlock(&stats_lock, key);
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2024 Albin Hjalmas (albin@bitman.se)
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef TX_SCHEDULER_H
+#define TX_SCHEDULER_H
+
+#include <zephyr/net/socket.h>
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "proxy_group.h"
+#include "server_proxy.h"
+
+typedef struct {
+    uint32_t wakeups; // Number of transmit windows flushed
+    uint32_t messages; // Number of requests transmitted
+    uint32_t failures; // Number of requests that failed or were not acknowledged
+    uint32_t retries; // Number of requests retried on another group member
+    uint32_t deferred; // Number of requests deferred to a backlog
+    uint32_t dropped; // Number of requests rejected because the queue was full
+    uint64_t radio_on_ms; // Accumulated time spent transmitting and awaiting replies
+    uint32_t max_latency_ms; // Largest delay added to a request by the scheduler
+    uint32_t wakeups_per_minute; // Wakeup rate over the last metrics interval
+} tx_scheduler_stats_t;
+
+/**
+ * @brief Start the transmit scheduler thread.
+ *
+ * Requests submitted to the scheduler are held back and flushed back-to-back
+ * in aligned transmit windows, letting the radio idle in between.
+ *
+ * @return int 0 if successful, otherwise a negative error code.
+ */
+int tx_scheduler_start(void);
+
+/**
+ * @brief Queue a print request to be sent through the specified server proxy.
+ *
+ * @param proxy The server proxy to send the request through.
+ * @param message The message to print. Copied into the queue.
+ * @return int 0 if successful, otherwise a negative error code.
+ */
+int tx_scheduler_print(server_proxy_t *proxy, const char *const message);
+
+/**
+ * @brief Queue a print request to be sent to a member of the specified proxy group.
+ *
+ * The member is selected when the batch is flushed. A request that fails
+ * with a transport error is retried on another member, up to
+ * CONFIG_APP_PROXY_GROUP_MAX_ATTEMPTS times in total. Only then is it
+ * deferred, to the backlog of the first member tried that has one.
+ *
+ * @param group The proxy group to send the request to.
+ * @param message The message to print. Copied into the queue.
+ * @return int 0 if successful, otherwise a negative error code.
+ */
+int tx_scheduler_print_group(proxy_group_t *group, const char *const message);
+
+/**
+ * @brief Queue a datagram to be sent on the specified socket.
+ *
+ * @param sock The socket to send the datagram on.
+ * @param addr The destination address.
+ * @param data The datagram payload. Copied into the queue.
+ * @param len The length of the payload.
+ * @return int 0 if successful, otherwise a negative error code.
+ */
+int tx_scheduler_sendto(int sock, const struct sockaddr_in6 *addr, const uint8_t *data,
+                        size_t len);
+
+/**
+ * @brief Get a snapshot of the transmit scheduler metrics.
+ *
+ * @param stats Destination for the metrics.
+ */
+void tx_scheduler_get_stats(tx_scheduler_stats_t *stats);
+
+#endif // TX_SCHEDULER_H
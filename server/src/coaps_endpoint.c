@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2024 Albin Hjalmas (albin@bitman.se)
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/net/socket.h>
+#include <zephyr/net/tls_credentials.h>
+#include <zephyr/sys/util.h>
+
+#include <errno.h>
+#include <string.h>
+
+#include "coaps_endpoint.h"
+#include "service_dispatch.h"
+
+LOG_MODULE_REGISTER(coaps_endpoint, LOG_LEVEL_INF);
+
+K_THREAD_STACK_DEFINE(coaps_thread_stack, CONFIG_APP_COAPS_STACK_SIZE);
+static struct k_thread coaps_thread_data;
+
+static uint8_t psk[32];
+
+static int add_credentials(void)
+{
+    size_t psk_len = hex2bin(CONFIG_APP_COAPS_PSK, strlen(CONFIG_APP_COAPS_PSK), psk, sizeof(psk));
+    if (psk_len == 0) {
+        LOG_ERR("Invalid PSK");
+        return -EINVAL;
+    }
+
+    int rc = tls_credential_add(CONFIG_APP_COAPS_SEC_TAG, TLS_CREDENTIAL_PSK, psk, psk_len);
+    if (rc < 0 && rc != -EEXIST) {
+        LOG_ERR("Failed to add PSK: %d", rc);
+        return rc;
+    }
+
+    rc = tls_credential_add(CONFIG_APP_COAPS_SEC_TAG, TLS_CREDENTIAL_PSK_ID,
+                            CONFIG_APP_COAPS_PSK_IDENTITY, strlen(CONFIG_APP_COAPS_PSK_IDENTITY));
+    if (rc < 0 && rc != -EEXIST) {
+        LOG_ERR("Failed to add PSK identity: %d", rc);
+        return rc;
+    }
+
+    return 0;
+}
+
+static int create_socket(void)
+{
+    int sock = socket(AF_INET6, SOCK_DGRAM, IPPROTO_DTLS_1_2);
+    if (sock < 0) {
+        LOG_ERR("Failed to create DTLS socket: %d", errno);
+        return -errno;
+    }
+
+    sec_tag_t sec_tag_list[] = { CONFIG_APP_COAPS_SEC_TAG };
+    int role = TLS_DTLS_ROLE_SERVER;
+
+    if (setsockopt(sock, SOL_TLS, TLS_SEC_TAG_LIST, sec_tag_list, sizeof(sec_tag_list)) < 0 ||
+        setsockopt(sock, SOL_TLS, TLS_DTLS_ROLE, &role, sizeof(role)) < 0) {
+        LOG_ERR("Failed to configure DTLS socket: %d", errno);
+        close(sock);
+        return -errno;
+    }
+
+#ifdef TLS_DTLS_CID
+    // Let a client keep its session when its address changes.
+    int cid = TLS_DTLS_CID_SUPPORTED;
+    if (setsockopt(sock, SOL_TLS, TLS_DTLS_CID, &cid, sizeof(cid)) < 0) {
+        LOG_WRN("DTLS connection ID not available: %d", errno);
+    }
+#endif
+
+    struct sockaddr_in6 bind_addr = {
+        .sin6_family = AF_INET6,
+        .sin6_addr = IN6ADDR_ANY_INIT,
+        .sin6_port = htons(CONFIG_APP_COAPS_PORT),
+    };
+
+    if (bind(sock, (struct sockaddr *)&bind_addr, sizeof(bind_addr)) < 0) {
+        LOG_ERR("Failed to bind DTLS socket: %d", errno);
+        close(sock);
+        return -errno;
+    }
+
+    return sock;
+}
+
+static void coaps_endpoint_thread(void *p1, void *p2, void *p3)
+{
+    ARG_UNUSED(p1);
+    ARG_UNUSED(p2);
+    ARG_UNUSED(p3);
+
+    static uint8_t buffer[CONFIG_COAP_SERVER_MESSAGE_SIZE];
+    struct sockaddr_in6 src_addr;
+    socklen_t addr_len;
+    struct pollfd fds = { .events = POLLIN };
+
+    while (1) {
+        int sock = create_socket();
+        if (sock < 0) {
+            return;
+        }
+
+        LOG_INF("CoAPS endpoint listening on port %d", CONFIG_APP_COAPS_PORT);
+
+        // The DTLS socket serves one session at a time, and ignores the
+        // handshakes of other clients. It is recreated when the session fails
+        // or goes idle, so that the next client can connect.
+        fds.fd = sock;
+
+        while (1) {
+            int rc = poll(&fds, 1, CONFIG_APP_COAPS_SESSION_IDLE_MS);
+            if (rc < 0) {
+                LOG_WRN("Failed to poll DTLS socket: %d", errno);
+                break;
+            }
+
+            if (rc == 0) {
+                LOG_DBG("DTLS session idle, making room for the next client");
+                break;
+            }
+
+            addr_len = sizeof(src_addr);
+            ssize_t len = recvfrom(sock, buffer, sizeof(buffer), 0,
+                                   (struct sockaddr *)&src_addr, &addr_len);
+            if (len < 0) {
+                LOG_WRN("DTLS session ended: %d", errno);
+                break;
+            }
+
+            service_dispatch(sock, buffer, len, (struct sockaddr *)&src_addr, addr_len);
+        }
+
+        close(sock);
+    }
+}
+
+int coaps_endpoint_start(void)
+{
+    int rc = add_credentials();
+    if (rc < 0) {
+        return rc;
+    }
+
+    k_thread_create(&coaps_thread_data, coaps_thread_stack,
+                    K_THREAD_STACK_SIZEOF(coaps_thread_stack), coaps_endpoint_thread, NULL, NULL,
+                    NULL, CONFIG_APP_COAPS_THREAD_PRIORITY, 0, K_NO_WAIT);
+
+    k_thread_name_set(&coaps_thread_data, "coaps_endpoint");
+
+    return 0;
+}
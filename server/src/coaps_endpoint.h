@@ -0,0 +1,16 @@
+/*
+ * Copyright (c) 2024 Albin Hjalmas (albin@bitman.se)
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef COAPS_ENDPOINT_H
+#define COAPS_ENDPOINT_H
+
+/**
+ * @brief Start serving the resources of the CoAP service over DTLS (CoAPS).
+ *
+ * @return int 0 if successful, otherwise a negative error code.
+ */
+int coaps_endpoint_start(void);
+
+#endif // COAPS_ENDPOINT_H
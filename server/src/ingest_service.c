@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2024 Albin Hjalmas (albin@bitman.se)
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/net/coap_service.h>
+#include <zephyr/net/net_ip.h>
+#include <zephyr/sys/byteorder.h>
+
+#ifdef CONFIG_LZ4
+#include <lz4.h>
+#endif
+
+#include "upstream_forwarder.h"
+
+LOG_MODULE_REGISTER(ingest_service, LOG_LEVEL_INF);
+
+#ifdef CONFIG_LZ4
+// The resource is also served by the CoAPS and OSCORE endpoint threads.
+static K_MUTEX_DEFINE(raw_lock);
+static uint8_t raw[CONFIG_APP_INGEST_MAX_BATCH_SIZE];
+#endif
+
+/**
+ * @brief Log the records of a decoded batch.
+ *
+ * @return int 0 if successful, -EBADMSG if the records are malformed.
+ */
+static int print_records(const char *source, const uint8_t *records, uint16_t len,
+                         uint16_t count)
+{
+    char line[UPSTREAM_RECORD_MAX_LEN + 1];
+    uint16_t offset = 0;
+    uint16_t printed = 0;
+
+    while (offset < len) {
+        uint8_t line_len = records[offset++];
+        if (line_len > len - offset) {
+            return -EBADMSG;
+        }
+
+        memcpy(line, &records[offset], line_len);
+        line[line_len] = '\0';
+        offset += line_len;
+        printed++;
+
+        LOG_INF("Print [%s]: %s", source, line);
+    }
+
+    return printed == count ? 0 : -EBADMSG;
+}
+
+static int ingest_put(struct coap_resource *resource, struct coap_packet *request,
+                      struct sockaddr *addr, socklen_t addr_len)
+{
+    char source[NET_IPV6_ADDR_LEN];
+    const uint8_t *payload;
+    uint16_t payload_len;
+    int rc;
+
+    payload = coap_packet_get_payload(request, &payload_len);
+    if (payload == NULL || payload_len < UPSTREAM_BATCH_HEADER_SIZE ||
+        payload[0] != UPSTREAM_BATCH_VERSION) {
+        LOG_ERR("Invalid batch (payload_len %u)", payload_len);
+        return COAP_RESPONSE_CODE_BAD_REQUEST;
+    }
+
+    const uint8_t *body = &payload[UPSTREAM_BATCH_HEADER_SIZE];
+    uint16_t body_len = payload_len - UPSTREAM_BATCH_HEADER_SIZE;
+    uint16_t count = sys_get_be16(&payload[18]);
+    uint16_t raw_len = sys_get_be16(&payload[20]);
+
+    if (raw_len > CONFIG_APP_INGEST_MAX_BATCH_SIZE) {
+        LOG_ERR("Batch too large (%u bytes)", raw_len);
+        return COAP_RESPONSE_CODE_REQUEST_TOO_LARGE;
+    }
+
+    net_addr_ntop(AF_INET6, &payload[2], source, sizeof(source));
+
+    if (!(payload[1] & UPSTREAM_BATCH_FLAG_LZ4)) {
+        if (body_len != raw_len) {
+            return COAP_RESPONSE_CODE_BAD_REQUEST;
+        }
+
+        rc = print_records(source, body, body_len, count);
+        return rc < 0 ? COAP_RESPONSE_CODE_BAD_REQUEST : COAP_RESPONSE_CODE_CHANGED;
+    }
+
+#ifdef CONFIG_LZ4
+    k_mutex_lock(&raw_lock, K_FOREVER);
+
+    // Decompressing into a buffer of exactly raw_len bytes also rejects
+    // batches whose length field lies.
+    int decompressed = LZ4_decompress_safe((const char *)body, (char *)raw, body_len, raw_len);
+    rc = decompressed == raw_len ? print_records(source, raw, raw_len, count) : -EBADMSG;
+
+    k_mutex_unlock(&raw_lock);
+
+    return rc < 0 ? COAP_RESPONSE_CODE_BAD_REQUEST : COAP_RESPONSE_CODE_CHANGED;
+#else
+    LOG_ERR("Compressed batch received, but LZ4 is not enabled");
+    return COAP_RESPONSE_CODE_NOT_IMPLEMENTED;
+#endif
+}
+
+static const char *const INGEST_PATH[] = { "ingest", NULL };
+COAP_RESOURCE_DEFINE(ingest, coap_server, { .put = ingest_put, .path = INGEST_PATH });
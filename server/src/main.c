@@ -21,7 +21,17 @@ LOG_MODULE_REGISTER(coap_server, LOG_LEVEL_DBG);
 #endif
 
 #include "coap_event_handler.h"
+#include "coaps_endpoint.h"
+#ifdef CONFIG_APP_OSCORE
+#include "oscore_endpoint.h"
+#endif
+#include "mcast_sub.h"
 #include "print_service.h"
+#include "service_dispatch.h"
+#include "tuning.h"
+#ifdef CONFIG_APP_UPSTREAM_FORWARDER
+#include "upstream_forwarder.h"
+#endif
 
 static const uint16_t coap_port = 5683;
 static const uint16_t multicast_port = 5685; // Different port for multicast group
@@ -45,11 +55,17 @@ static const uint16_t multicast_port = 5685; // Different port for multicast gro
     }
 
 #define STACK_SIZE 2048
-#define PRIORITY 7
 
 K_THREAD_STACK_DEFINE(thread_stack, STACK_SIZE);
 struct k_thread thread_data;
 
+static int32_t thread_priority = 7; // Tunable as "mcast.priority"
+
+static void apply_priority(int32_t value)
+{
+    k_thread_priority_set(&thread_data, value);
+}
+
 static int join_multicast_group(struct in6_addr *mcast_addr)
 {
     struct net_if_mcast_addr *if_maddr;
@@ -105,14 +121,19 @@ static int join_multicast_groups(void)
 static void process_received_message(int sock)
 {
     struct sockaddr_in6 src_addr;
-    socklen_t addr_len = sizeof(src_addr);
     char buffer[128];
     int len;
 
     while (1) {
-        len = recvfrom(sock, buffer, sizeof(buffer), 0, (struct sockaddr *)&src_addr, &addr_len);
+        // Leave room for the terminator, a full-sized datagram is truncated.
+        len = mcast_sub_receive(sock, (uint8_t *)buffer, sizeof(buffer) - 1, &src_addr);
+        if (len == -EBADMSG) {
+            LOG_WRN("Dropped a datagram without sequence number");
+            continue;
+        }
+
         if (len < 0) {
-            LOG_ERR("Failed to receive data");
+            LOG_ERR("Failed to receive data: %d", len);
             break;
         }
 
@@ -154,18 +175,55 @@ int main(void)
         return -errno;
     }
 
+    ret = mcast_sub_init();
+    if (ret < 0) {
+        LOG_ERR("Failed to initialize multicast subscriber (err %d)", ret);
+        close(multicast_sock);
+        return ret;
+    }
+
     k_thread_create(&thread_data, thread_stack, K_THREAD_STACK_SIZEOF(thread_stack),
                     (k_thread_entry_t)process_received_message, (void *)(intptr_t)multicast_sock,
-                    NULL, NULL, PRIORITY, 0, K_NO_WAIT);
+                    NULL, NULL, thread_priority, 0, K_NO_WAIT);
 
     k_thread_name_set(&thread_data, "multicast_recv_thread");
 
+    tuning_param_register("mcast.priority", &thread_priority, K_HIGHEST_APPLICATION_THREAD_PRIO,
+                          K_LOWEST_APPLICATION_THREAD_PRIO, apply_priority);
+
+    // Parameters may only be changed over CoAPS or OSCORE.
+    tuning_coap_set_auth(service_dispatch_is_secured);
+
     int rc = print_service_init();
     if (rc < 0) {
         LOG_ERR("Failed to initialize print service (err %d)", rc);
         return rc;
     }
 
+#ifdef CONFIG_APP_UPSTREAM_FORWARDER
+    rc = upstream_forwarder_start();
+    if (rc < 0) {
+        LOG_ERR("Failed to start upstream forwarder (err %d)", rc);
+        return rc;
+    }
+#endif
+
+#ifdef CONFIG_APP_COAPS
+    rc = coaps_endpoint_start();
+    if (rc < 0) {
+        LOG_ERR("Failed to start CoAPS endpoint (err %d)", rc);
+        return rc;
+    }
+#endif
+
+#ifdef CONFIG_APP_OSCORE
+    rc = oscore_endpoint_start();
+    if (rc < 0) {
+        LOG_ERR("Failed to start OSCORE endpoint (err %d)", rc);
+        return rc;
+    }
+#endif
+
     return 0;
 }
 
@@ -0,0 +1,262 @@
+/*
+ * Copyright (c) 2024 Albin Hjalmas (albin@bitman.se)
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/net/net_ip.h>
+#include <zephyr/net/socket.h>
+#include <zephyr/sys/byteorder.h>
+
+#include <errno.h>
+#include <string.h>
+
+#include "mcast_sub.h"
+#include "tuning.h"
+
+LOG_MODULE_REGISTER(mcast_sub, LOG_LEVEL_INF);
+
+#define MAX_SENDERS CONFIG_APP_MCAST_SUB_MAX_SENDERS
+#define REPORT_INTERVAL_MS CONFIG_APP_MCAST_SUB_REPORT_INTERVAL_MS
+
+// Datagrams up to this far behind the highest sequence number are checked
+// for duplicates and no longer count as lost when they arrive.
+#define WINDOW_SIZE 32
+
+// A larger jump in the sequence numbers is taken as a restart of the
+// publisher, rather than as loss. Publishers start at a random number.
+#define RESTART_GAP 1024
+
+typedef struct {
+    bool in_use;
+    mcast_sub_sender_t sender;
+    uint32_t highest; // Highest sequence number received
+    uint32_t window; // Bit n is set if highest - n has been received
+    uint32_t jitter; // Interarrival jitter (ms), scaled by 16
+    uint32_t transit; // Arrival uptime minus timestamp of the previous datagram
+    uint32_t report_highest; // Highest sequence number at the previous report
+    uint32_t report_received; // Datagrams received at the previous report
+    int64_t report_at; // Uptime (ms) when the next report is due
+} slot_t;
+
+static K_MUTEX_DEFINE(slots_lock);
+static slot_t slots[MAX_SENDERS];
+
+// Totals over all publishers, exported as counters.
+static uint32_t total_received;
+static uint32_t total_lost;
+static uint32_t total_reordered;
+static uint32_t total_duplicates;
+
+static slot_t *find_slot(const struct sockaddr_in6 *src, int64_t now)
+{
+    slot_t *oldest = &slots[0];
+
+    for (size_t i = 0; i < MAX_SENDERS; i++) {
+        slot_t *slot = &slots[i];
+        if (slot->in_use && slot->sender.addr.sin6_port == src->sin6_port &&
+            net_ipv6_addr_cmp(&slot->sender.addr.sin6_addr, &src->sin6_addr)) {
+            return slot;
+        }
+
+        if (!slot->in_use ||
+            (oldest->in_use && slot->sender.last_seen < oldest->sender.last_seen)) {
+            oldest = slot;
+        }
+    }
+
+    if (oldest->in_use) {
+        LOG_WRN("Sender table full, forgetting %s",
+                net_sprint_ipv6_addr(&oldest->sender.addr.sin6_addr));
+    }
+
+    *oldest = (slot_t){ .in_use = true, .sender = { .addr = *src, .last_seen = now } };
+
+    return oldest;
+}
+
+static void resync(slot_t *slot, uint32_t seq, int64_t now)
+{
+    slot->highest = seq;
+    slot->window = 1;
+    slot->report_highest = seq - 1;
+    slot->report_received = slot->sender.received;
+    slot->report_at = now + REPORT_INTERVAL_MS;
+}
+
+/**
+ * @brief Account for a datagram in the statistics of its publisher.
+ *
+ * @return bool true if the datagram is new, false if it is a duplicate.
+ */
+static bool update_sender(slot_t *slot, uint32_t seq, uint32_t timestamp, int64_t now)
+{
+    mcast_sub_sender_t *sender = &slot->sender;
+    bool first = sender->received == 0 && sender->duplicates == 0;
+    int32_t delta = (int32_t)(seq - slot->highest);
+    bool restart = !first && (delta >= RESTART_GAP || delta <= -RESTART_GAP);
+
+    if (first || restart) {
+        if (restart) {
+            LOG_INF("Sender %s restarted at %u", net_sprint_ipv6_addr(&sender->addr.sin6_addr),
+                    seq);
+            sender->restarts++;
+        }
+
+        resync(slot, seq, now);
+    } else if (delta > 0) {
+        // Count the skipped datagrams as lost until they turn up.
+        sender->lost += delta - 1;
+        total_lost += delta - 1;
+        slot->window = delta < WINDOW_SIZE ? (slot->window << delta) | 1 : 1;
+        slot->highest = seq;
+    } else {
+        uint32_t age = -delta;
+        uint32_t bit = age < WINDOW_SIZE ? BIT(age) : 0;
+
+        if (age == 0 || (slot->window & bit)) {
+            sender->duplicates++;
+            total_duplicates++;
+            return false;
+        }
+
+        // It was counted as lost when a later one arrived. Beyond the window
+        // it cannot be told from a duplicate, and is taken as late.
+        slot->window |= bit;
+        sender->reordered++;
+        total_reordered++;
+        if (sender->lost > 0) {
+            sender->lost--;
+            total_lost--;
+        }
+    }
+
+    // Interarrival jitter as in RFC 3550. The clocks are not synchronized,
+    // but their offset cancels out in the difference of the transit times.
+    uint32_t transit = (uint32_t)now - timestamp;
+    if (!first && !restart) {
+        int32_t d = (int32_t)(transit - slot->transit);
+        slot->jitter += (d < 0 ? -d : d) - ((slot->jitter + 8) >> 4);
+        sender->jitter_ms = slot->jitter >> 4;
+    }
+
+    slot->transit = transit;
+    sender->received++;
+    sender->last_seen = now;
+    total_received++;
+
+    return true;
+}
+
+/**
+ * @brief Build the report for a publisher, if one is due.
+ *
+ * @return bool true if a report was built.
+ */
+static bool build_report(slot_t *slot, int64_t now, uint8_t *report)
+{
+    if (now < slot->report_at) {
+        return false;
+    }
+
+    uint32_t expected = slot->highest - slot->report_highest;
+    uint32_t received = slot->sender.received - slot->report_received;
+    uint32_t lost = expected > received ? expected - received : 0;
+    uint8_t fraction = expected > 0 ? MIN(((uint64_t)lost << 8) / expected, UINT8_MAX) : 0;
+
+    report[0] = MCAST_PUBSUB_VERSION;
+    report[1] = MCAST_PUBSUB_TYPE_REPORT;
+    sys_put_be32(slot->highest, &report[2]);
+    report[6] = fraction;
+    sys_put_be16(MIN(slot->sender.jitter_ms, UINT16_MAX), &report[7]);
+
+    LOG_INF("Sender %s: received %u, lost %u, reordered %u, duplicates %u, jitter %u ms",
+            net_sprint_ipv6_addr(&slot->sender.addr.sin6_addr), slot->sender.received,
+            slot->sender.lost, slot->sender.reordered, slot->sender.duplicates,
+            slot->sender.jitter_ms);
+
+    slot->report_highest = slot->highest;
+    slot->report_received = slot->sender.received;
+    slot->report_at = now + REPORT_INTERVAL_MS;
+
+    return true;
+}
+
+int mcast_sub_init(void)
+{
+    tuning_counter_register("mcast.received", &total_received);
+    tuning_counter_register("mcast.lost", &total_lost);
+    tuning_counter_register("mcast.reordered", &total_reordered);
+    tuning_counter_register("mcast.duplicates", &total_duplicates);
+
+    return 0;
+}
+
+int mcast_sub_receive(int sock, uint8_t *buf, size_t len, struct sockaddr_in6 *src)
+{
+    uint8_t report[MCAST_PUBSUB_REPORT_SIZE];
+    socklen_t addr_len;
+    ssize_t received;
+    bool fresh;
+    bool report_due;
+
+    if (buf == NULL || src == NULL || len < MCAST_PUBSUB_HEADER_SIZE) {
+        return -EINVAL;
+    }
+
+    do {
+        addr_len = sizeof(*src);
+        received = recvfrom(sock, buf, len, 0, (struct sockaddr *)src, &addr_len);
+        if (received < 0) {
+            return -errno;
+        }
+
+        if (received < MCAST_PUBSUB_HEADER_SIZE || buf[0] != MCAST_PUBSUB_VERSION ||
+            buf[1] != MCAST_PUBSUB_TYPE_DATA) {
+            return -EBADMSG;
+        }
+
+        uint32_t seq = sys_get_be32(&buf[2]);
+        uint32_t timestamp = sys_get_be32(&buf[6]);
+        int64_t now = k_uptime_get();
+
+        k_mutex_lock(&slots_lock, K_FOREVER);
+
+        slot_t *slot = find_slot(src, now);
+        fresh = update_sender(slot, seq, timestamp, now);
+        report_due = build_report(slot, now, report);
+
+        k_mutex_unlock(&slots_lock);
+
+        if (report_due) {
+            if (sendto(sock, report, sizeof(report), 0, (struct sockaddr *)src,
+                       sizeof(*src)) < 0) {
+                LOG_WRN("Failed to send report: %d", errno);
+            }
+        }
+    } while (!fresh);
+
+    received -= MCAST_PUBSUB_HEADER_SIZE;
+    memmove(buf, &buf[MCAST_PUBSUB_HEADER_SIZE], received);
+
+    return received;
+}
+
+size_t mcast_sub_get_senders(mcast_sub_sender_t *senders, size_t max)
+{
+    size_t count = 0;
+
+    k_mutex_lock(&slots_lock, K_FOREVER);
+
+    for (size_t i = 0; i < MAX_SENDERS && count < max; i++) {
+        if (slots[i].in_use) {
+            senders[count++] = slots[i].sender;
+        }
+    }
+
+    k_mutex_unlock(&slots_lock);
+
+    return count;
+}
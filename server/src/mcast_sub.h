@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2024 Albin Hjalmas (albin@bitman.se)
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef MCAST_SUB_H
+#define MCAST_SUB_H
+
+#include <zephyr/net/socket.h>
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "mcast_pubsub.h"
+
+typedef struct {
+    struct sockaddr_in6 addr; // Address and port the publisher sends from
+    uint32_t received; // Number of distinct datagrams received
+    uint32_t lost; // Number of datagrams missing, less those that arrived late
+    uint32_t reordered; // Number of datagrams received after a later one
+    uint32_t duplicates; // Number of datagrams received more than once
+    uint32_t restarts; // Number of times the sequence numbers jumped, e.g. on reboot
+    uint32_t jitter_ms; // Interarrival jitter as in RFC 3550
+    int64_t last_seen; // Uptime (ms) of the latest datagram
+} mcast_sub_sender_t;
+
+/**
+ * @brief Initialize the subscriber.
+ *
+ * @return int 0 if successful, otherwise a negative error code.
+ */
+int mcast_sub_init(void);
+
+/**
+ * @brief Receive a published datagram.
+ *
+ * Blocks until a datagram arrives, updates the statistics of its publisher
+ * and answers with a report every CONFIG_APP_MCAST_SUB_REPORT_INTERVAL_MS.
+ * Publishers are tracked in a table of CONFIG_APP_MCAST_SUB_MAX_SENDERS
+ * entries, the least recently seen is replaced when it is full.
+ *
+ * @param sock The socket to receive on.
+ * @param buf Destination for the payload.
+ * @param len The size of the destination.
+ * @param src Destination for the address of the publisher.
+ * @return int The length of the payload if successful, -EBADMSG if the
+ * datagram is not a published one, otherwise a negative error code.
+ */
+int mcast_sub_receive(int sock, uint8_t *buf, size_t len, struct sockaddr_in6 *src);
+
+/**
+ * @brief Copy the table of publishers.
+ *
+ * @param senders Destination for the publishers.
+ * @param max The number of elements in the destination.
+ * @return size_t The number of publishers copied.
+ */
+size_t mcast_sub_get_senders(mcast_sub_sender_t *senders, size_t max);
+
+#endif // MCAST_SUB_H
@@ -0,0 +1,300 @@
+/*
+ * Copyright (c) 2024 Albin Hjalmas (albin@bitman.se)
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/net/coap.h>
+#include <zephyr/net/socket.h>
+
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+
+#include "oscore.h"
+#include "oscore_endpoint.h"
+#include "service_dispatch.h"
+
+LOG_MODULE_REGISTER(oscore_endpoint, LOG_LEVEL_INF);
+
+#define MAX_OPTIONS 16
+#define RESPONSE_SIZE 64
+
+K_THREAD_STACK_DEFINE(oscore_thread_stack, CONFIG_APP_OSCORE_STACK_SIZE);
+static struct k_thread oscore_thread_data;
+
+#define MAX_CLIENTS CONFIG_APP_OSCORE_MAX_CLIENTS
+
+// One security context per client, keyed by the Sender ID of the client,
+// which is the Recipient ID of the context. Each keeps its own replay window.
+typedef struct {
+    bool in_use;
+    oscore_ctx_t ctx;
+} client_t;
+
+static K_MUTEX_DEFINE(clients_lock);
+static client_t clients[MAX_CLIENTS];
+
+// Only touched by the endpoint thread.
+static uint8_t request_buf[OSCORE_MAX_MESSAGE];
+static uint8_t plain_buf[OSCORE_MAX_MESSAGE];
+static uint8_t protected_buf[RESPONSE_SIZE + OSCORE_MAX_OVERHEAD];
+
+static int send_packet(int sock, const struct coap_packet *packet, struct sockaddr *addr,
+                       socklen_t addr_len)
+{
+    if (sendto(sock, packet->data, packet->offset, 0, addr, addr_len) < 0) {
+        LOG_ERR("Failed to send response: %d", errno);
+        return -errno;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Answer a request that failed verification.
+ *
+ * Such errors are sent unprotected (RFC 8613, section 8.2).
+ */
+static int send_error(int sock, const struct coap_packet *request, uint8_t code,
+                      struct sockaddr *addr, socklen_t addr_len)
+{
+    struct coap_packet response;
+    uint8_t buf[RESPONSE_SIZE];
+
+    if (coap_header_get_type(request) != COAP_TYPE_CON) {
+        return 0;
+    }
+
+    int rc = coap_ack_init(&response, request, buf, sizeof(buf), code);
+    if (rc < 0) {
+        return rc;
+    }
+
+    return send_packet(sock, &response, addr, addr_len);
+}
+
+/**
+ * @brief Find the security context of a client, deriving it on first contact.
+ *
+ * @param created Set if the context was derived for this request.
+ * @return client_t* The client, or NULL if it has no valid kid or the table is
+ * full. Contexts are never evicted, since that would reset the replay window.
+ */
+static client_t *find_client(const struct coap_packet *request, bool *created)
+{
+    uint8_t kid[OSCORE_MAX_ID_LEN];
+    uint8_t kid_len;
+    client_t *free_slot = NULL;
+
+    *created = false;
+
+    int rc = oscore_request_kid(request, kid, &kid_len);
+    if (rc < 0) {
+        LOG_DBG("No usable kid: %d", rc);
+        return NULL;
+    }
+
+    char recipient_id[2 * OSCORE_MAX_ID_LEN + 1];
+    bin2hex(kid, kid_len, recipient_id, sizeof(recipient_id));
+
+    // Both directions would share a key and nonces.
+    if (strcasecmp(recipient_id, CONFIG_APP_OSCORE_SENDER_ID) == 0) {
+        LOG_WRN("Client uses the Sender ID of the server");
+        return NULL;
+    }
+
+    for (size_t i = 0; i < MAX_CLIENTS; i++) {
+        client_t *client = &clients[i];
+        if (!client->in_use) {
+            free_slot = free_slot == NULL ? client : free_slot;
+        } else if (client->ctx.recipient.id_len == kid_len &&
+                   memcmp(client->ctx.recipient.id, kid, kid_len) == 0) {
+            return client;
+        }
+    }
+
+    if (free_slot == NULL) {
+        LOG_WRN("Client table full, rejecting a new client");
+        return NULL;
+    }
+
+    k_mutex_lock(&clients_lock, K_FOREVER);
+    rc = oscore_ctx_init(&free_slot->ctx, CONFIG_APP_OSCORE_MASTER_SECRET,
+                         CONFIG_APP_OSCORE_MASTER_SALT, CONFIG_APP_OSCORE_SENDER_ID,
+                         recipient_id);
+    free_slot->in_use = rc == 0;
+    k_mutex_unlock(&clients_lock);
+
+    if (rc < 0) {
+        LOG_ERR("Failed to derive security context: %d", rc);
+        return NULL;
+    }
+
+    *created = true;
+
+    return free_slot;
+}
+
+static void forget_client(client_t *client)
+{
+    k_mutex_lock(&clients_lock, K_FOREVER);
+    oscore_ctx_free(&client->ctx);
+    client->in_use = false;
+    k_mutex_unlock(&clients_lock);
+}
+
+static int handle_request(int sock, size_t len, struct sockaddr *addr, socklen_t addr_len)
+{
+    struct coap_packet request;
+    struct coap_packet plain;
+    struct coap_option options[MAX_OPTIONS];
+    oscore_request_t binding;
+
+    int rc = coap_packet_parse(&request, request_buf, len, NULL, 0);
+    if (rc < 0) {
+        LOG_DBG("Dropping malformed request: %d", rc);
+        return rc;
+    }
+
+    bool created;
+    client_t *client = find_client(&request, &created);
+    if (client == NULL) {
+        return send_error(sock, &request, COAP_RESPONSE_CODE_UNAUTHORIZED, addr, addr_len);
+    }
+
+    k_mutex_lock(&clients_lock, K_FOREVER);
+    rc = oscore_unprotect_request(&client->ctx, &request, plain_buf, sizeof(plain_buf), &plain,
+                                  &binding);
+    k_mutex_unlock(&clients_lock);
+
+    if (rc < 0) {
+        LOG_WRN("Rejected request: %d", rc);
+        if (created) {
+            // Do not let unverified kids fill the table.
+            forget_client(client);
+        }
+
+        return send_error(sock, &request,
+                          rc == -EPERM ? COAP_RESPONSE_CODE_UNAUTHORIZED :
+                                         COAP_RESPONSE_CODE_BAD_REQUEST,
+                          addr, addr_len);
+    }
+
+    // The resources look up the options of the inner request, e.g. Uri-Path.
+    rc = coap_packet_parse(&plain, plain.data, plain.offset, options, ARRAY_SIZE(options));
+    if (rc < 0) {
+        LOG_WRN("Dropping malformed inner request: %d", rc);
+        return send_error(sock, &request, COAP_RESPONSE_CODE_BAD_REQUEST, addr, addr_len);
+    }
+
+    uint8_t type = coap_header_get_type(&plain);
+
+    rc = service_dispatch_request(&plain, options, ARRAY_SIZE(options), addr, addr_len);
+    if (rc <= 0 || type != COAP_TYPE_CON) {
+        return rc < 0 ? rc : 0;
+    }
+
+    struct coap_packet response;
+    struct coap_packet protected;
+    uint8_t buf[RESPONSE_SIZE];
+
+    rc = coap_ack_init(&response, &plain, buf, sizeof(buf), rc);
+    if (rc < 0) {
+        LOG_ERR("Failed to initialize response: %d", rc);
+        return rc;
+    }
+
+    k_mutex_lock(&clients_lock, K_FOREVER);
+    rc = oscore_protect_response(&client->ctx, &binding, &response, protected_buf,
+                                 sizeof(protected_buf), &protected);
+    k_mutex_unlock(&clients_lock);
+    if (rc < 0) {
+        LOG_ERR("Failed to protect response: %d", rc);
+        return rc;
+    }
+
+    return send_packet(sock, &protected, addr, addr_len);
+}
+
+static void oscore_endpoint_thread(void *p1, void *p2, void *p3)
+{
+    ARG_UNUSED(p2);
+    ARG_UNUSED(p3);
+
+    int sock = (int)(intptr_t)p1;
+    struct sockaddr_in6 src_addr;
+    socklen_t addr_len;
+
+    LOG_INF("OSCORE endpoint listening on port %d", CONFIG_APP_OSCORE_PORT);
+
+    while (1) {
+        addr_len = sizeof(src_addr);
+        ssize_t len = recvfrom(sock, request_buf, sizeof(request_buf), 0,
+                               (struct sockaddr *)&src_addr, &addr_len);
+        if (len < 0) {
+            LOG_ERR("Failed to receive data: %d", errno);
+            break;
+        }
+
+        handle_request(sock, len, (struct sockaddr *)&src_addr, addr_len);
+    }
+
+    close(sock);
+}
+
+int oscore_endpoint_start(void)
+{
+    int sock = socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock < 0) {
+        LOG_ERR("Failed to create OSCORE socket: %d", errno);
+        return -errno;
+    }
+
+    struct sockaddr_in6 bind_addr = {
+        .sin6_family = AF_INET6,
+        .sin6_addr = IN6ADDR_ANY_INIT,
+        .sin6_port = htons(CONFIG_APP_OSCORE_PORT),
+    };
+
+    if (bind(sock, (struct sockaddr *)&bind_addr, sizeof(bind_addr)) < 0) {
+        LOG_ERR("Failed to bind OSCORE socket: %d", errno);
+        close(sock);
+        return -errno;
+    }
+
+    k_thread_create(&oscore_thread_data, oscore_thread_stack,
+                    K_THREAD_STACK_SIZEOF(oscore_thread_stack), oscore_endpoint_thread,
+                    (void *)(intptr_t)sock, NULL, NULL, CONFIG_APP_OSCORE_THREAD_PRIORITY, 0,
+                    K_NO_WAIT);
+
+    k_thread_name_set(&oscore_thread_data, "oscore_endpoint");
+
+    return 0;
+}
+
+void oscore_endpoint_get_stats(oscore_stats_t *stats)
+{
+    oscore_stats_t client_stats;
+
+    memset(stats, 0, sizeof(*stats));
+
+    k_mutex_lock(&clients_lock, K_FOREVER);
+
+    for (size_t i = 0; i < MAX_CLIENTS; i++) {
+        if (!clients[i].in_use) {
+            continue;
+        }
+
+        oscore_get_stats(&clients[i].ctx, &client_stats);
+        stats->protected += client_stats.protected;
+        stats->unprotected += client_stats.unprotected;
+        stats->rejected += client_stats.rejected;
+        stats->protect_cycles += client_stats.protect_cycles;
+        stats->unprotect_cycles += client_stats.unprotect_cycles;
+    }
+
+    k_mutex_unlock(&clients_lock);
+}
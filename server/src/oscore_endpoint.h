@@ -0,0 +1,28 @@
+/*
+ * Copyright (c) 2024 Albin Hjalmas (albin@bitman.se)
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef OSCORE_ENDPOINT_H
+#define OSCORE_ENDPOINT_H
+
+#include "oscore.h"
+
+/**
+ * @brief Start serving the resources of the CoAP service protected with OSCORE.
+ *
+ * Each client is served with its own security context, selected by the kid
+ * of its requests. See CONFIG_APP_OSCORE_MAX_CLIENTS.
+ *
+ * @return int 0 if successful, otherwise a negative error code.
+ */
+int oscore_endpoint_start(void);
+
+/**
+ * @brief Get a snapshot of the protection metrics of the OSCORE endpoint.
+ *
+ * @param stats Destination for the metrics.
+ */
+void oscore_endpoint_get_stats(oscore_stats_t *stats);
+
+#endif // OSCORE_ENDPOINT_H
@@ -9,8 +9,27 @@
 #include <zephyr/net/coap_service.h>
 #include <zephyr/net/net_ip.h>
 
+#ifdef CONFIG_APP_UPSTREAM_FORWARDER
+#include "upstream_forwarder.h"
+#endif
+
 LOG_MODULE_REGISTER(print_service, LOG_LEVEL_DBG);
 
+/**
+ * @brief Check that a payload is a single NUL-terminated string.
+ *
+ * The payload is not guaranteed to be terminated, so it is never read beyond
+ * its length.
+ */
+static bool is_valid_message(const uint8_t *payload, uint16_t payload_len)
+{
+    if (payload == NULL || payload_len == 0) {
+        return false;
+    }
+
+    return memchr(payload, '\0', payload_len) == &payload[payload_len - 1];
+}
+
 static int print_put(struct coap_resource *resource, struct coap_packet *request,
                      struct sockaddr *addr, socklen_t addr_len)
 {
@@ -20,19 +39,33 @@ static int print_put(struct coap_resource *resource, struct coap_packet *request
     LOG_DBG("Received PUT request");
 
     payload = coap_packet_get_payload(request, &payload_len);
-    if (payload_len == 0) {
+    if (payload == NULL || payload_len == 0) {
         LOG_ERR("Invalid payload length");
-        return COAP_RESPONSE_CODE_INTERNAL_ERROR;
+        return COAP_RESPONSE_CODE_BAD_REQUEST;
     }
 
     LOG_HEXDUMP_DBG(payload, payload_len, "Payload");
 
-    if (strlen(payload) + 1 != payload_len) {
-        LOG_ERR("Invalid payload (strlen %zu, payload_len %u)", strlen(payload) + 1, payload_len);
-        return COAP_RESPONSE_CODE_INTERNAL_ERROR;
+    if (!is_valid_message(payload, payload_len)) {
+        LOG_ERR("Invalid payload (not a single terminated string, payload_len %u)",
+                payload_len);
+        return COAP_RESPONSE_CODE_BAD_REQUEST;
+    }
+
+#ifdef CONFIG_APP_UPSTREAM_FORWARDER
+    // Refuse the line rather than lose it, the client retries it later.
+    int rc = upstream_forwarder_submit(addr, (const char *)payload, payload_len - 1);
+    if (rc == -ENOBUFS) {
+        LOG_WRN("Forwarder full, refusing line");
+        return COAP_RESPONSE_CODE_SERVICE_UNAVAILABLE;
+    }
+
+    if (rc < 0) {
+        LOG_WRN("Line not forwarded: %d", rc);
     }
+#endif
 
-    LOG_INF("Print: %s", payload);
+    LOG_INF("Print: %s", (const char *)payload);
 
     return COAP_RESPONSE_CODE_CHANGED;
 }
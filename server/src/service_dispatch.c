@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2024 Albin Hjalmas (albin@bitman.se)
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/net/coap.h>
+#include <zephyr/net/coap_service.h>
+#include <zephyr/net/socket.h>
+
+#include <errno.h>
+
+#include "service_dispatch.h"
+
+LOG_MODULE_REGISTER(service_dispatch, LOG_LEVEL_INF);
+
+#define MAX_OPTIONS 16
+#define RESPONSE_SIZE 64
+
+// Defined by COAP_SERVICE_DEFINE in main.c.
+extern const struct coap_service coap_server;
+
+// The endpoints dispatch one request at a time, from the thread recorded here.
+static K_MUTEX_DEFINE(dispatch_lock);
+static k_tid_t dispatching;
+
+bool service_dispatch_is_secured(void)
+{
+    // Only the dispatching thread itself can find its own ID here.
+    return dispatching == k_current_get();
+}
+
+int service_dispatch_request(struct coap_packet *request, struct coap_option *options,
+                             uint8_t opt_num, struct sockaddr *addr, socklen_t addr_len)
+{
+    // GET handlers send their reply themselves with coap_resource_send(), which
+    // writes to the plaintext socket of the CoAP service.
+    if (coap_header_get_code(request) == COAP_METHOD_GET) {
+        return COAP_RESPONSE_CODE_NOT_ALLOWED;
+    }
+
+    k_mutex_lock(&dispatch_lock, K_FOREVER);
+    dispatching = k_current_get();
+
+    int rc = coap_handle_request_len(request, coap_server.res_begin,
+                                     COAP_SERVICE_RESOURCE_COUNT(&coap_server), options, opt_num,
+                                     addr, addr_len);
+
+    dispatching = NULL;
+    k_mutex_unlock(&dispatch_lock);
+
+    // Translate errors to response codes the same way the CoAP service does.
+    switch (rc) {
+    case -ENOENT:
+        return COAP_RESPONSE_CODE_NOT_FOUND;
+    case -ENOTSUP:
+        return COAP_RESPONSE_CODE_BAD_REQUEST;
+    case -EPERM:
+        return COAP_RESPONSE_CODE_NOT_ALLOWED;
+    default:
+        return rc;
+    }
+}
+
+int service_dispatch(int sock, uint8_t *data, size_t len, struct sockaddr *addr,
+                     socklen_t addr_len)
+{
+    struct coap_packet request;
+    struct coap_option options[MAX_OPTIONS];
+
+    int rc = coap_packet_parse(&request, data, len, options, ARRAY_SIZE(options));
+    if (rc < 0) {
+        LOG_DBG("Dropping malformed request: %d", rc);
+        return rc;
+    }
+
+    uint8_t type = coap_header_get_type(&request);
+
+    rc = service_dispatch_request(&request, options, ARRAY_SIZE(options), addr, addr_len);
+    if (rc <= 0 || type != COAP_TYPE_CON) {
+        return rc < 0 ? rc : 0;
+    }
+
+    struct coap_packet response;
+    uint8_t buf[RESPONSE_SIZE];
+
+    rc = coap_ack_init(&response, &request, buf, sizeof(buf), rc);
+    if (rc < 0) {
+        LOG_ERR("Failed to initialize response: %d", rc);
+        return rc;
+    }
+
+    if (sendto(sock, response.data, response.offset, 0, addr, addr_len) < 0) {
+        LOG_ERR("Failed to send response: %d", errno);
+        return -errno;
+    }
+
+    return 0;
+}
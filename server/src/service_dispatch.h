@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2024 Albin Hjalmas (albin@bitman.se)
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef SERVICE_DISPATCH_H
+#define SERVICE_DISPATCH_H
+
+#include <zephyr/net/coap.h>
+#include <zephyr/net/socket.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * @brief Dispatch a parsed CoAP request to the resources of the coap_server service.
+ *
+ * Lets endpoints that receive requests outside of the CoAP service socket
+ * share its resources. GET is refused with 4.05 Method Not Allowed, because
+ * the resources answer it themselves over the plaintext CoAP service socket,
+ * e.g. GET /config and GET /metrics.
+ *
+ * @param request The request to dispatch.
+ * @param options The options of the request, as filled in by coap_packet_parse().
+ * @param opt_num The number of elements in the option storage.
+ * @param addr The address of the requester.
+ * @param addr_len The length of the address.
+ * @return int The response code of the request, or a negative error code if
+ * the request should not be answered.
+ */
+int service_dispatch_request(struct coap_packet *request, struct coap_option *options,
+                             uint8_t opt_num, struct sockaddr *addr, socklen_t addr_len);
+
+/**
+ * @brief Tell whether the calling resource handler serves a request
+ * dispatched by service_dispatch_request().
+ *
+ * Only the secured endpoints (CoAPS and OSCORE) dispatch through this module,
+ * so resources can use it to refuse requests that came over plaintext CoAP.
+ *
+ * @return true if the request arrived over a secured endpoint.
+ */
+bool service_dispatch_is_secured(void);
+
+/**
+ * @brief Parse, dispatch and answer a CoAP request received on the specified socket.
+ *
+ * @param sock The socket the request was received on. Used to send the reply.
+ * @param data The received datagram.
+ * @param len The length of the datagram.
+ * @param addr The address of the requester.
+ * @param addr_len The length of the address.
+ * @return int 0 if successful, otherwise a negative error code.
+ */
+int service_dispatch(int sock, uint8_t *data, size_t len, struct sockaddr *addr,
+                     socklen_t addr_len);
+
+#endif // SERVICE_DISPATCH_H
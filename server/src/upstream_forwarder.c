@@ -0,0 +1,402 @@
+/*
+ * Copyright (c) 2024 Albin Hjalmas (albin@bitman.se)
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/net/coap.h>
+#include <zephyr/net/net_ip.h>
+#include <zephyr/sys/byteorder.h>
+
+#include <errno.h>
+#include <string.h>
+
+#ifdef CONFIG_APP_UPSTREAM_FORWARDER_LZ4
+#include <lz4.h>
+#endif
+
+#include "coap_client.h"
+#include "tuning.h"
+#include "upstream_forwarder.h"
+
+LOG_MODULE_REGISTER(upstream_forwarder, LOG_LEVEL_INF);
+
+#define MAX_STREAMS CONFIG_APP_UPSTREAM_FORWARDER_MAX_STREAMS
+#define STREAM_SIZE CONFIG_APP_UPSTREAM_FORWARDER_STREAM_SIZE
+#define REPLY_TIMEOUT K_MSEC(reply_timeout_ms)
+#define RETRY_MIN_MS CONFIG_APP_UPSTREAM_FORWARDER_RETRY_MIN_MS
+#define RETRY_MAX_MS CONFIG_APP_UPSTREAM_FORWARDER_RETRY_MAX_MS
+
+#define REPLY_SIZE 64
+#define STATS_INTERVAL 32 // Batches between two metrics log lines
+
+typedef struct {
+    struct in6_addr source; // Address of the client the records came from
+    uint16_t len; // Bytes of records in data, 0 if the stream is free
+    uint16_t count; // Number of records in data
+    int64_t first_at; // Uptime (ms) when the oldest record was added
+    uint8_t data[STREAM_SIZE];
+} stream_t;
+
+K_THREAD_STACK_DEFINE(forwarder_thread_stack, CONFIG_APP_UPSTREAM_FORWARDER_STACK_SIZE);
+static struct k_thread forwarder_thread_data;
+
+// Tunable at runtime, see tuning.h.
+static int32_t flush_threshold = CONFIG_APP_UPSTREAM_FORWARDER_FLUSH_THRESHOLD;
+static int32_t flush_interval_ms = CONFIG_APP_UPSTREAM_FORWARDER_FLUSH_INTERVAL_MS;
+static int32_t reply_timeout_ms = CONFIG_APP_UPSTREAM_FORWARDER_REPLY_TIMEOUT_MS;
+
+BUILD_ASSERT(CONFIG_APP_UPSTREAM_FORWARDER_FLUSH_THRESHOLD >= 1 &&
+                     CONFIG_APP_UPSTREAM_FORWARDER_FLUSH_THRESHOLD <= STREAM_SIZE,
+             "The flush threshold must be between 1 and the stream size");
+
+static K_MUTEX_DEFINE(streams_lock);
+static K_SEM_DEFINE(flush_sem, 0, 1);
+static stream_t streams[MAX_STREAMS];
+static upstream_forwarder_stats_t stats;
+
+// Only touched by the forwarder thread. The batch stays here until the
+// upstream server has acknowledged it, which bounds memory to the streams
+// plus a single batch in flight.
+static coap_client_t upstream;
+static uint8_t raw[STREAM_SIZE];
+static uint8_t batch[UPSTREAM_BATCH_HEADER_SIZE + STREAM_SIZE];
+static size_t batch_len;
+static uint16_t batch_raw_len;
+static uint32_t backoff_ms;
+static int64_t retry_at;
+static uint8_t reply_buf[REPLY_SIZE];
+
+#ifdef CONFIG_APP_UPSTREAM_FORWARDER_LZ4
+static LZ4_stream_t lz4_state;
+#endif
+
+static stream_t *find_stream(const struct in6_addr *source)
+{
+    stream_t *free_stream = NULL;
+
+    for (size_t i = 0; i < MAX_STREAMS; i++) {
+        if (streams[i].len == 0) {
+            if (free_stream == NULL) {
+                free_stream = &streams[i];
+            }
+            continue;
+        }
+
+        if (net_ipv6_addr_cmp(&streams[i].source, source)) {
+            return &streams[i];
+        }
+    }
+
+    if (free_stream != NULL) {
+        free_stream->source = *source;
+    }
+
+    return free_stream;
+}
+
+/**
+ * @brief Take the stream that is most overdue, if any, out of the table.
+ *
+ * @return bool true if a stream was copied into raw.
+ */
+static bool take_stream(int64_t now, struct in6_addr *source, uint16_t *count)
+{
+    stream_t *ready = NULL;
+
+    k_mutex_lock(&streams_lock, K_FOREVER);
+
+    for (size_t i = 0; i < MAX_STREAMS; i++) {
+        stream_t *stream = &streams[i];
+        if (stream->len == 0) {
+            continue;
+        }
+
+        if (stream->len < flush_threshold && now - stream->first_at < flush_interval_ms) {
+            continue;
+        }
+
+        if (ready == NULL || stream->first_at < ready->first_at) {
+            ready = stream;
+        }
+    }
+
+    if (ready != NULL) {
+        memcpy(raw, ready->data, ready->len);
+        batch_raw_len = ready->len;
+        *source = ready->source;
+        *count = ready->count;
+
+        ready->len = 0;
+        ready->count = 0;
+    }
+
+    k_mutex_unlock(&streams_lock);
+
+    return ready != NULL;
+}
+
+static void encode_batch(const struct in6_addr *source, uint16_t count)
+{
+    uint8_t *body = &batch[UPSTREAM_BATCH_HEADER_SIZE];
+    size_t body_len = batch_raw_len;
+
+    batch[0] = UPSTREAM_BATCH_VERSION;
+    batch[1] = 0;
+    memcpy(&batch[2], source, sizeof(*source));
+    sys_put_be16(count, &batch[18]);
+    sys_put_be16(batch_raw_len, &batch[20]);
+
+#ifdef CONFIG_APP_UPSTREAM_FORWARDER_LZ4
+    // Only keep the compressed form if it is smaller, so the body never
+    // outgrows the raw records.
+    int compressed = LZ4_compress_fast_extState(&lz4_state, (const char *)raw, (char *)body,
+                                                batch_raw_len, batch_raw_len - 1, 1);
+    if (compressed > 0) {
+        batch[1] |= UPSTREAM_BATCH_FLAG_LZ4;
+        body_len = compressed;
+    } else {
+        memcpy(body, raw, batch_raw_len);
+    }
+#else
+    memcpy(body, raw, batch_raw_len);
+#endif
+
+    batch_len = UPSTREAM_BATCH_HEADER_SIZE + body_len;
+}
+
+static int send_batch(void)
+{
+    static const char *const PATH[] = { "ingest", NULL };
+
+    struct coap_packet reply;
+
+    int rc = coap_client_put(&upstream, PATH, batch, batch_len);
+    if (rc < 0) {
+        return rc;
+    }
+
+    rc = coap_client_wait_and_receive(&upstream, rc, &reply, reply_buf, sizeof(reply_buf),
+                                      REPLY_TIMEOUT);
+    if (rc < 0) {
+        return rc;
+    }
+
+    uint8_t code = coap_header_get_code(&reply);
+    if (code == COAP_RESPONSE_CODE_SERVICE_UNAVAILABLE) {
+        // The upstream server is applying backpressure itself.
+        return -EAGAIN;
+    }
+
+    if (code != COAP_RESPONSE_CODE_CHANGED) {
+        LOG_ERR("Batch rejected by upstream server (code %u.%02u)", code >> 5, code & 0x1f);
+        return -EIO;
+    }
+
+    return 0;
+}
+
+static void complete_batch(bool acknowledged)
+{
+    k_mutex_lock(&streams_lock, K_FOREVER);
+
+    if (acknowledged) {
+        stats.batches++;
+        stats.raw_bytes += batch_raw_len;
+        stats.sent_bytes += batch_len - UPSTREAM_BATCH_HEADER_SIZE;
+    } else {
+        stats.dropped++;
+    }
+
+    upstream_forwarder_stats_t snapshot = stats;
+
+    k_mutex_unlock(&streams_lock);
+
+    batch_len = 0;
+    backoff_ms = 0;
+    retry_at = 0;
+
+    if (acknowledged && snapshot.batches % STATS_INTERVAL == 0) {
+        LOG_INF("Forwarded %u batches, %u -> %u bytes, %u records rejected, %u failures, "
+                "%u batches dropped",
+                snapshot.batches, snapshot.raw_bytes, snapshot.sent_bytes, snapshot.rejected,
+                snapshot.failures, snapshot.dropped);
+    }
+}
+
+static void backoff(int rc)
+{
+    k_mutex_lock(&streams_lock, K_FOREVER);
+    stats.failures++;
+    k_mutex_unlock(&streams_lock);
+
+    backoff_ms = backoff_ms == 0 ? RETRY_MIN_MS : MIN(backoff_ms * 2, RETRY_MAX_MS);
+    retry_at = k_uptime_get() + backoff_ms;
+
+    LOG_WRN("Failed to forward batch (%d), retrying in %u ms", rc, backoff_ms);
+}
+
+/**
+ * @brief Get the time until the forwarder has something to do.
+ */
+static k_timeout_t next_wakeup(void)
+{
+    if (batch_len > 0) {
+        return K_TIMEOUT_ABS_MS(retry_at);
+    }
+
+    int64_t due = -1;
+
+    k_mutex_lock(&streams_lock, K_FOREVER);
+
+    for (size_t i = 0; i < MAX_STREAMS; i++) {
+        if (streams[i].len > 0 && (due < 0 || streams[i].first_at + flush_interval_ms < due)) {
+            due = streams[i].first_at + flush_interval_ms;
+        }
+    }
+
+    k_mutex_unlock(&streams_lock);
+
+    return due < 0 ? K_FOREVER : K_TIMEOUT_ABS_MS(due);
+}
+
+static void forwarder_thread(void *p1, void *p2, void *p3)
+{
+    ARG_UNUSED(p1);
+    ARG_UNUSED(p2);
+    ARG_UNUSED(p3);
+
+    struct in6_addr source;
+    uint16_t count;
+
+    while (1) {
+        int64_t now = k_uptime_get();
+
+        if (batch_len == 0 && take_stream(now, &source, &count)) {
+            encode_batch(&source, count);
+        }
+
+        if (batch_len > 0 && now >= retry_at) {
+            int rc = send_batch();
+            if (rc == -EIO) {
+                // Resending the same batch will not help, drop it.
+                complete_batch(false);
+                continue;
+            }
+
+            if (rc < 0) {
+                backoff(rc);
+            } else {
+                LOG_DBG("Forwarded %u records, %u -> %zu bytes", count, batch_raw_len,
+                        batch_len - UPSTREAM_BATCH_HEADER_SIZE);
+                complete_batch(true);
+
+                // Other streams may be due as well.
+                continue;
+            }
+        }
+
+        k_sem_take(&flush_sem, next_wakeup());
+    }
+}
+
+static void register_tunables(void)
+{
+    tuning_param_register("fwd.flush_threshold", &flush_threshold, 1, STREAM_SIZE, NULL);
+    tuning_param_register("fwd.flush_interval_ms", &flush_interval_ms, 10, 3600 * MSEC_PER_SEC,
+                          NULL);
+    tuning_param_register("fwd.reply_timeout_ms", &reply_timeout_ms, 10, 60 * MSEC_PER_SEC, NULL);
+
+    tuning_counter_register("fwd.accepted", &stats.accepted);
+    tuning_counter_register("fwd.rejected", &stats.rejected);
+    tuning_counter_register("fwd.batches", &stats.batches);
+    tuning_counter_register("fwd.failures", &stats.failures);
+    tuning_counter_register("fwd.dropped", &stats.dropped);
+    tuning_counter_register("fwd.raw_bytes", &stats.raw_bytes);
+    tuning_counter_register("fwd.sent_bytes", &stats.sent_bytes);
+}
+
+int upstream_forwarder_start(void)
+{
+    int rc = coap_client_start(&upstream, CONFIG_APP_UPSTREAM_FORWARDER_ADDR,
+                               CONFIG_APP_UPSTREAM_FORWARDER_PORT);
+    if (rc < 0) {
+        LOG_ERR("Failed to start upstream client: %d", rc);
+        return rc;
+    }
+
+    register_tunables();
+
+    k_thread_create(&forwarder_thread_data, forwarder_thread_stack,
+                    K_THREAD_STACK_SIZEOF(forwarder_thread_stack), forwarder_thread, NULL, NULL,
+                    NULL, CONFIG_APP_UPSTREAM_FORWARDER_THREAD_PRIORITY, 0, K_NO_WAIT);
+
+    k_thread_name_set(&forwarder_thread_data, "upstream_forwarder");
+
+    LOG_INF("Forwarding to [%s]:%u", CONFIG_APP_UPSTREAM_FORWARDER_ADDR,
+            CONFIG_APP_UPSTREAM_FORWARDER_PORT);
+
+    return 0;
+}
+
+int upstream_forwarder_submit(const struct sockaddr *src, const char *line, size_t len)
+{
+    struct in6_addr source = { 0 };
+    bool wake = false;
+    int rc = 0;
+
+    if (src == NULL || line == NULL) {
+        return -EINVAL;
+    }
+
+    if (len > UPSTREAM_RECORD_MAX_LEN || len + 1 > STREAM_SIZE) {
+        return -EMSGSIZE;
+    }
+
+    if (src->sa_family == AF_INET6) {
+        source = net_sin6(src)->sin6_addr;
+    }
+
+    k_mutex_lock(&streams_lock, K_FOREVER);
+
+    stream_t *stream = find_stream(&source);
+    if (stream == NULL || stream->len + 1 + len > STREAM_SIZE) {
+        // Refuse rather than drop, so the client keeps the line until the
+        // forwarder has caught up.
+        stats.rejected++;
+        rc = -ENOBUFS;
+        goto exit;
+    }
+
+    if (stream->len == 0) {
+        stream->first_at = k_uptime_get();
+    }
+
+    stream->data[stream->len++] = (uint8_t)len;
+    memcpy(&stream->data[stream->len], line, len);
+    stream->len += len;
+    stream->count++;
+    stats.accepted++;
+
+    // Wake the forwarder to schedule the flush of a new stream, or to send
+    // one that reached the threshold.
+    wake = stream->count == 1 || stream->len >= flush_threshold;
+
+exit:
+    k_mutex_unlock(&streams_lock);
+
+    if (wake) {
+        k_sem_give(&flush_sem);
+    }
+
+    return rc;
+}
+
+void upstream_forwarder_get_stats(upstream_forwarder_stats_t *stats_out)
+{
+    k_mutex_lock(&streams_lock, K_FOREVER);
+    *stats_out = stats;
+    k_mutex_unlock(&streams_lock);
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2024 Albin Hjalmas (albin@bitman.se)
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef UPSTREAM_FORWARDER_H
+#define UPSTREAM_FORWARDER_H
+
+#include <zephyr/net/socket.h>
+#include <zephyr/sys/util.h>
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Batch format, sent as the payload of a PUT to /ingest on the upstream server:
+ *
+ *   [0]      Version, UPSTREAM_BATCH_VERSION
+ *   [1]      Flags, UPSTREAM_BATCH_FLAG_*
+ *   [2..17]  IPv6 address of the client the records came from
+ *   [18..19] Number of records (big endian)
+ *   [20..21] Length of the records before compression (big endian)
+ *   [22..]   The records, LZ4 compressed if UPSTREAM_BATCH_FLAG_LZ4 is set
+ *
+ * Each record is a length byte followed by that many bytes of text, without
+ * a terminator.
+ */
+#define UPSTREAM_BATCH_VERSION 1
+#define UPSTREAM_BATCH_FLAG_LZ4 BIT(0)
+#define UPSTREAM_BATCH_HEADER_SIZE 22
+#define UPSTREAM_RECORD_MAX_LEN UINT8_MAX
+
+typedef struct {
+    uint32_t accepted; // Records added to a stream
+    uint32_t rejected; // Records refused because the memory was exhausted
+    uint32_t batches; // Batches acknowledged by the upstream server
+    uint32_t failures; // Attempts to send a batch that failed
+    uint32_t dropped; // Batches refused by the upstream server
+    uint32_t raw_bytes; // Record bytes in the acknowledged batches
+    uint32_t sent_bytes; // Record bytes as sent, after compression
+} upstream_forwarder_stats_t;
+
+/**
+ * @brief Start forwarding printed lines to the upstream server.
+ *
+ * @return int 0 if successful, otherwise a negative error code.
+ */
+int upstream_forwarder_start(void);
+
+/**
+ * @brief Queue a printed line for forwarding.
+ *
+ * The line is appended to the stream of the client that sent it. Streams
+ * are sent as a batch once they have filled up to the flush threshold or
+ * their oldest record has waited for the flush interval.
+ *
+ * @param src The address of the client the line came from.
+ * @param line The line, without a terminator.
+ * @param len The length of the line.
+ * @return int 0 if successful, -ENOBUFS if the stream of the client is full or
+ * no stream is free, otherwise a negative error code.
+ */
+int upstream_forwarder_submit(const struct sockaddr *src, const char *line, size_t len);
+
+/**
+ * @brief Get a snapshot of the forwarding metrics.
+ *
+ * @param stats Destination for the metrics.
+ */
+void upstream_forwarder_get_stats(upstream_forwarder_stats_t *stats);
+
+#endif // UPSTREAM_FORWARDER_H